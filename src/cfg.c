@@ -12,6 +12,7 @@
 #include "rtc.h"
 #include "tick.h"
 #include "cfg.h"
+#include "cfg_event.h"
 #include "cfg_parse.h"
 #define MHZ 48
 #include "delay.h"
@@ -39,6 +40,7 @@ void cfg_panic(char * s, int16_t d)
       cfg_log(s, strlen(s));
     if (cfg_line_number)
       cfg_log_attr("at line", cfg_line_number);
+    cfg_log_sync();
     delay_ms(2000);
   }
 }
@@ -86,21 +88,75 @@ static er_t match_cfg_file(struct dirent * dp)
 static struct fil cfg;
 static uint32_t cfg_offset = 0;
 
+#ifndef CFG_LOG_BINARY
+#define CFG_LOG_BINARY 0
+#endif
+#if CFG_LOG_BINARY
+static struct fil evt;
+typedef char cfg_event_is_12_bytes[sizeof(struct cfg_event) == 12 ? 1 : -1];
+
+/* <site>-<n>.EVT beside the LOG, in the cwd */
+static int8_t evt_open(void)
+{
+  char fn[11];
+  int8_t er, i;
+
+  memset(fn, ' ', 8);
+  for (i = 0; cfg_sitename[i]; i++)
+    fn[i] = cfg_sitename[i];
+  fn[i++] = '-';
+  fn[i] = *cfg_unit;
+  memcpy(fn + 8, "EVT", 3);
+  er = fil_create(fn, 0, &evt);
+  if (FIL_EEXIST == er)
+    er = fil_open(fn, &evt);
+  return(er);
+}
+#endif
+
+/*
+  The config is read in one forward pass.  cfg_get() reads on
+  through the sector in sd_buffer, and only calls fil_seek()
+  (which walks the chain forward from where it was) to get the
+  next.  Nothing else may use the card meanwhile, or read_sector
+  must be cleared.  cfg_unget() pushes the characters back on
+  unget_buf[], rather than seeking back, which would walk the
+  chain again from the head.  cfg_offset is the offset of the
+  next character got.
+ */
+#define CFG_UNGET_MAX 16
+static char unget_buf[CFG_UNGET_MAX];
+static uint8_t nr_unget;
+static uint32_t read_offset;          /* next character from the file */
+static bool read_sector;              /* sd_buffer holds it */
+
 void cfg_unget(char * tok, int8_t len)
 {
   CFG_PANIC((len > cfg_offset), "Internal sd_buffer underflow", 0);
+  CFG_PANIC((nr_unget + len > CFG_UNGET_MAX), "Internal unget overflow", 0);
   cfg_offset -= len;
-  for (len--; len > -1; len--)
+  for (len--; len > -1; len--) {
     if ('\n' == tok[len]) cfg_line_number--;
+    unget_buf[nr_unget++] = tok[len];
+  }
 }
 
 char cfg_get(void)
 {
   char ch;
   int8_t er;
-  er = fil_seek(&cfg, cfg_offset);
-  CFG_PANIC((er != 0), "fil_seek error ", er);
-  ch = sd_buffer[cfg_offset & 511];
+
+  if (nr_unget) {
+    ch = unget_buf[--nr_unget];
+  } else {
+    if (!read_sector || !(read_offset & 511)) {
+      er = fil_seek(&cfg, read_offset);
+      CFG_PANIC((er != 0), "fil_seek error ", er);
+      read_sector = true;
+    }
+    ch = sd_buffer[read_offset & 511];
+    read_offset++;
+  }
   cfg_offset++;
   if ('\n' == ch) cfg_line_number++;
   return(ch);
@@ -117,6 +173,9 @@ int8_t cfg_init(bool flag_need_sync)
 
   tick_init();
   *cfg_sitename = 0;
+  cfg_offset = read_offset = 0;
+  read_sector = false;
+  nr_unget = 0;
   dbg(tx_puts("Calling fil_scan_cwd\r\n"));
 
   er = fil_scan_cwd(0, match_cfg_file, &cfg);
@@ -126,6 +185,10 @@ int8_t cfg_init(bool flag_need_sync)
   dbg(tx_puts("sitename = \""));
   dbg(tx_puts(cfg_sitename));
   dbg(tx_puts("\"\r\n"));
+#if CFG_LOG_BINARY
+  er = evt_open();
+  CFG_PANIC((er != 0), "Can't open .EVT file:", er);
+#endif
 
   /*
     Begin evaluating the config
@@ -176,6 +239,8 @@ int8_t cfg_init(bool flag_need_sync)
       er = fil_seek(&cfg, bol);
       if (er) return(er);
       sd_buffer[bol & 511] = '#';
+      sd_buffer_dirty();
+      read_sector = false;
       flag_synced = 1;
       continue;
     }
@@ -202,30 +267,98 @@ int8_t cfg_init(bool flag_need_sync)
   return(nr_timespecs);
 }
 
+/*
+  Log text is collected in RAM and goes to the file when it
+  completes the file's last sector, or at cfg_log_flush(), so the
+  sector is checked out once instead of once per fragment.  With
+  CFG_LOG_BUFSZ 0 every fragment goes straight to fil_append().
+ */
+#ifndef CFG_LOG_BUFSZ
+#define CFG_LOG_BUFSZ 512
+#endif
+struct logbuf {
+  struct fil * fp;
+  uint16_t len;
+  char buf[CFG_LOG_BUFSZ?CFG_LOG_BUFSZ:1];
+};
+static struct logbuf log_text = { &cfg };
+
+static void lb_flush(struct logbuf * lb)
+{
+  if (lb->len)
+    (void)fil_append(lb->fp, (uint8_t *)lb->buf, lb->len);
+  lb->len = 0;
+}
+
+static void lb_add(struct logbuf * lb, char * buf, uint16_t len)
+{
+#if CFG_LOG_BUFSZ
+  uint16_t i;
+  while (len) {
+    i = 512 - (lb->fp->file_size + lb->len)%512; /* to end of sector */
+    if (i > CFG_LOG_BUFSZ - lb->len) i = CFG_LOG_BUFSZ - lb->len;
+    if (i > len) i = len;
+    memcpy(lb->buf + lb->len, buf, i);
+    lb->len += i;
+    buf += i;
+    len -= i;
+    if (!((lb->fp->file_size + lb->len)%512) || CFG_LOG_BUFSZ == lb->len)
+      lb_flush(lb);
+  }
+#else
+  (void)fil_append(lb->fp, (uint8_t *)buf, len);
+#endif
+}
+
+#if CFG_LOG_BINARY
+static struct logbuf log_evt = { &evt };
+#endif
+
+void cfg_log_flush(void)
+{
+  lb_flush(&log_text);
+#if CFG_LOG_BINARY
+  lb_flush(&log_evt);
+#endif
+}
+
 static void append(char * buf, uint16_t len)
 {
   uint16_t i;
-  fil_append(&cfg, (uint8_t *)buf, len);
   for (i = 0; i < len; i++)
     tx_putc(buf[i]);
+  lb_add(&log_text, buf, len);
 }
   
 static uint8_t unbcd(uint8_t b) { return(((b>>4)&0xf)*10 + (b&0xf)); }
+
+static struct rtc stamp;              /* time of the latest stamp */
+static bool stamp_pending;            /* not yet in the text */
+static void new_stamp(void)
+{
+  if (!tick_need_stamp()) return;
+  rtc_now(&stamp);
+  stamp_pending = true;
+  /* While were here, update our dirent with the time */
+  cfg.wdate = FIL_DATE(2000+unbcd(stamp.year),
+    unbcd(stamp.month), unbcd(stamp.day_of_month));
+  cfg.wtime = FIL_TIME(unbcd(stamp.hours),
+    unbcd(stamp.minutes), unbcd(stamp.seconds));
+#if CFG_LOG_BINARY
+  evt.wdate = cfg.wdate;
+  evt.wtime = cfg.wtime;
+#endif
+}
+
 static void maybe_put_stamp(void)
 {
-  if (tick_need_stamp()) {
-    char * stamp;
-    struct rtc now;
-    rtc_now(&now);
-    append("\r\n", 2);
-    stamp = rtc_print(&now);
-    append(stamp, strlen(stamp));
-    /* While were here, update our dirent with the time */
-    cfg.wdate = FIL_DATE(2000+unbcd(now.year),
-      unbcd(now.month), unbcd(now.day_of_month));
-    cfg.wtime = FIL_TIME(unbcd(now.hours),
-      unbcd(now.minutes), unbcd(now.seconds));
-  }
+  char * cp;
+  new_stamp();
+  if (!stamp_pending) return;
+  stamp_pending = false;
+  append("\r\n", 2);
+  cp = rtc_print(&stamp);
+  append(cp, strlen(cp));
 }
 
 void cfg_log(char * buf, uint16_t len)
@@ -237,32 +370,76 @@ void cfg_log(char * buf, uint16_t len)
 
 void cfg_logs(char * buf) { cfg_log(buf, strlen(buf)); }
 
+#if CFG_LOG_BINARY
+/* Still shown as text on the usart */
+static void event(char * attr, uint8_t type, int32_t val)
+{
+  struct cfg_event e;
+  char buf[FMT_BUFSZ];
+
+  new_stamp();
+  e.when = CFG_EV_WHEN(unbcd(stamp.year), unbcd(stamp.month),
+    unbcd(stamp.day_of_month), unbcd(stamp.hours),
+    unbcd(stamp.minutes), unbcd(stamp.seconds));
+  e.id = cfg_event_id(attr);
+  e.type = type;
+  e.spare = 0;
+  e.value = val;
+  lb_add(&log_evt, (char *)&e, sizeof(e));
+  tx_putc(' ');
+  tx_puts(attr);
+  tx_putc('=');
+  tx_puts(CFG_EV_U32 == type ?
+    fmt_u32d_r(val, buf) : fmt_i32d_r(val, buf));
+}
+
 void cfg_log_attr(char * attr, int16_t val)
 {
-  char * cp;
+  event(attr, CFG_EV_I16, val);
+}
+void cfg_log_lattr(char * attr, int32_t val)
+{
+  event(attr, CFG_EV_I32, val);
+}
+void cfg_log_ulattr(char * attr, uint32_t val)
+{
+  event(attr, CFG_EV_U32, val);
+}
+#else
+void cfg_log_attr(char * attr, int16_t val)
+{
+  char * cp, buf[FMT_BUFSZ];
   cfg_log(attr, strlen(attr));
   append("=", 1);
-  cp = fmt_i16d(val);
+  cp = fmt_i16d_r(val, buf);
   append(cp, strlen(cp));
 }
 
 void cfg_log_lattr(char * attr, int32_t val)
 {
-  char * cp;
+  char * cp, buf[FMT_BUFSZ];
   cfg_log(attr, strlen(attr));
   append("=", 1);
-  cp = fmt_i32d(val);
+  cp = fmt_i32d_r(val, buf);
   /* cp = fmt_32x(val); */
   append(cp, strlen(cp));
 }
 void cfg_log_ulattr(char * attr, uint32_t val)
 {
-  char * cp;
+  char * cp, buf[FMT_BUFSZ];
   cfg_log(attr, strlen(attr));
   append("=", 1);
-  cp = fmt_u32d(val);
+  cp = fmt_u32d_r(val, buf);
   /* cp = fmt_32x(val); */
   append(cp, strlen(cp));
 }
+#endif /* CFG_LOG_BINARY */
 
-void cfg_log_sync(void) { fil_save_dirent(&cfg, 0, true); }
+void cfg_log_sync(void)
+{
+  cfg_log_flush();
+#if CFG_LOG_BINARY
+  fil_save_dirent(&evt, 0, false);
+#endif
+  fil_save_dirent(&cfg, 0, true);
+}
@@ -29,6 +29,11 @@ extern void cfg_logs(char * buf);
 extern void cfg_log_attr(char * attr, int16_t val);
 extern void cfg_log_lattr(char * attr, int32_t val);
 extern void cfg_log_ulattr(char * attr, uint32_t val);
-/* flush to disk */
+/*
+  Log text is held in RAM until it fills a sector of the file.
+  cfg_log_flush() appends what there is to the file (through the
+  sector cache), cfg_log_sync() flushes and writes it to disk.
+ */
+extern void cfg_log_flush(void);
 extern void cfg_log_sync(void);
 #endif /* CFG_H */
@@ -0,0 +1,46 @@
+#ifndef CFG_EVENT_H
+#define CFG_EVENT_H
+#include <stdint.h>
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Binary log records.  Compiled with CFG_LOG_BINARY,
+  cfg_log_attr() and friends write these to <site>-<n>.EVT
+  beside the .LOG instead of name=value text, which is slow to
+  format on the M0 and grows the LOG fast.  Free text (cfg_log(),
+  cfg_logs()) still goes to the .LOG.  evlog.c turns them back
+  into text, or CSV, on the host.
+ */
+struct cfg_event {
+  uint32_t when;                      /* CFG_EV_WHEN() of the stamp */
+  uint16_t id;                        /* cfg_event_id() of the name */
+  uint8_t type;                       /* CFG_EV_I16 etc. */
+  uint8_t spare;
+  int32_t value;
+};
+#define CFG_EV_I16 1                  /* from cfg_log_attr() */
+#define CFG_EV_I32 2                  /* cfg_log_lattr() */
+#define CFG_EV_U32 3                  /* cfg_log_ulattr() */
+
+/* Year from 2000 (to 2063), month, day, hours, minutes, seconds */
+#define CFG_EV_WHEN(y, mo, d, h, mi, s) \
+  (((uint32_t)(y)<<26) | ((uint32_t)(mo)<<22) | ((uint32_t)(d)<<17) | \
+  ((uint32_t)(h)<<12) | ((uint32_t)(mi)<<6) | (uint32_t)(s))
+
+/*
+  Names are not stored, only this hash of them (FNV-1a folded to
+  16 bits), so the decoder gets them back by hashing the string
+  literals in the sources.  So a name built at run time, or
+  passed in from a file evlog is not given, comes out as #xxxx;
+  and with only 16 bits two names can share an id, which evlog
+  refuses (rename one).
+ */
+static inline uint16_t cfg_event_id(const char * name)
+{
+  uint32_t h;
+  for (h = 2166136261UL; *name; name++) {
+    h ^= (uint8_t)*name;
+    h *= 16777619UL;
+  }
+  return((h >> 16) ^ (h & 0xffff));
+}
+#endif /* CFG_EVENT_H */
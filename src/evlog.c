@@ -0,0 +1,187 @@
+/*
+  Copyright 2020 Harold Tay GPLv3
+  Host tool: decode a binary event file (cfg_event.h) written
+  with CFG_LOG_BINARY, as LOG style text or as CSV.
+
+  Usage: evlog [-c] SITEA-0.EVT source.c ...
+  Names are recovered by hashing every string literal in the
+  sources, e.g. *.c of the firmware that wrote the file.  An id
+  matching no literal is shown as #xxxx.  Two literals with the
+  same id are an error, as there is no telling which was logged.
+  -c prints CSV: time,name,value.
+ */
+#define _XOPEN_SOURCE 700
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cfg_event.h"
+
+#define NR_NAMES 2048
+static struct { uint16_t id; char * name; } names[NR_NAMES];
+static int nr_names, nr_collisions;
+
+static void add_name(char * s)
+{
+  uint16_t id;
+  int i;
+
+  id = cfg_event_id(s);
+  for (i = 0; i < nr_names; i++) {
+    if (names[i].id != id) continue;
+    if (strcmp(names[i].name, s)) {
+      fprintf(stderr, "\"%s\" and \"%s\" both hash to %04x\n",
+        names[i].name, s, id);
+      nr_collisions++;
+    }
+    return;
+  }
+  if (nr_names >= NR_NAMES) return;
+  names[nr_names].id = id;
+  names[nr_names++].name = strdup(s);
+}
+
+/*
+  Every string literal that could be a name, skipping comments
+  and character constants.
+ */
+static int scan(char * fn)
+{
+  char buf[64];
+  int ch, prev, len, bad;
+  enum { CODE, STR, CHR, LINE, BLOCK } state;
+  FILE * fp;
+
+  fp = fopen(fn, "r");
+  if (!fp) return(-1);
+  state = CODE;
+  len = bad = 0;
+  for (prev = 0; EOF != (ch = getc(fp)); prev = ch) {
+    switch (state) {
+    case CODE:
+      if ('"' == ch) { state = STR; len = bad = 0; }
+      else if ('\'' == ch) state = CHR;
+      else if ('/' == prev && '/' == ch) state = LINE;
+      else if ('/' == prev && '*' == ch) { state = BLOCK; ch = 0; }
+      break;
+    case STR:
+      if ('\\' == ch) {                 /* escape, not a name */
+        (void)getc(fp);
+        bad = 1;
+        ch = 0;
+      } else if ('"' == ch) {
+        if (len && !bad) {
+          buf[len] = '\0';
+          add_name(buf);
+        }
+        state = CODE;
+      } else if (len < (int)sizeof(buf) - 1 &&
+        (('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z') ||
+        ('0' <= ch && ch <= '9') || '_' == ch || ' ' == ch))
+        buf[len++] = ch;
+      else
+        bad = 1;
+      break;
+    case CHR:
+      if ('\\' == ch) { (void)getc(fp); ch = 0; }
+      else if ('\'' == ch) state = CODE;
+      break;
+    case LINE:
+      if ('\n' == ch) state = CODE;
+      break;
+    case BLOCK:
+      if ('*' == prev && '/' == ch) { state = CODE; ch = 0; }
+      break;
+    }
+  }
+  fclose(fp);
+  return(0);
+}
+
+static char * name_of(uint16_t id)
+{
+  static char buf[8];
+  int i;
+  for (i = 0; i < nr_names; i++)
+    if (names[i].id == id) return(names[i].name);
+  snprintf(buf, sizeof(buf), "#%04x", id);
+  return(buf);
+}
+
+/* As rtc_print() */
+static char * when_of(uint32_t when)
+{
+  static char buf[32];
+  static char * wk[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = 100 + (when >> 26);
+  tm.tm_mon = ((when >> 22) & 0xf) - 1;
+  tm.tm_mday = (when >> 17) & 0x1f;
+  tm.tm_hour = (when >> 12) & 0x1f;
+  tm.tm_min = (when >> 6) & 0x3f;
+  tm.tm_sec = when & 0x3f;
+  tm.tm_isdst = -1;
+  (void)mktime(&tm);                  /* for tm_wday */
+  snprintf(buf, sizeof(buf), "20%02u-%02u-%02uT%02u:%02u:%02u %s",
+    when >> 26, (when >> 22) & 0xf, (when >> 17) & 0x1f,
+    (when >> 12) & 0x1f, (when >> 6) & 0x3f, when & 0x3f,
+    wk[tm.tm_wday % 7]);
+  return(buf);
+}
+
+int main(int argc, char ** argv)
+{
+  struct cfg_event e;
+  uint32_t last;
+  int ch, csv, i, first;
+  FILE * fp;
+
+  csv = 0;
+  while ((ch = getopt(argc, argv, "c")) != -1) {
+    switch (ch) {
+    case 'c': csv = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-c] file.EVT source.c ...\n", argv[0]);
+      return(1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Need an event file\n");
+    return(1);
+  }
+  for (i = optind + 1; i < argc; i++)
+    if (scan(argv[i])) {
+      perror(argv[i]);
+      return(1);
+    }
+  if (nr_collisions) return(1);
+
+  fp = fopen(argv[optind], "rb");
+  if (!fp) {
+    perror(argv[optind]);
+    return(1);
+  }
+  if (csv) printf("time,name,value\n");
+  for (first = 1, last = 0; 1 == fread(&e, sizeof(e), 1, fp); first = 0) {
+    if (csv) {
+      printf("%s,%s,", when_of(e.when), name_of(e.id));
+    } else {
+      if (first || e.when != last)
+        printf("%s%s", first ? "" : "\n", when_of(e.when));
+      printf(" %s=", name_of(e.id));
+    }
+    if (CFG_EV_U32 == e.type)
+      printf("%lu", (unsigned long)(uint32_t)e.value);
+    else
+      printf("%ld", (long)e.value);
+    if (csv) printf("\n");
+    last = e.when;
+  }
+  if (!csv && !first) printf("\n");
+  fclose(fp);
+  return(0);
+}
@@ -88,7 +88,7 @@ er_t fil_sanitise(char fn[11])
 
 er_t fil_reinit(void)
 {
-  return(sd_init());
+  return(sd_reinit());
 }
 
 static er_t checksig(void)
@@ -113,6 +113,8 @@ static uint32_t fil_root_dir_1st_cluster;
 static uint32_t fil_cwd_1st_cluster;
 static uint32_t fil_clusters_start;
 static uint32_t fil_fat_start;
+static uint32_t fil_fsinfo_sector;    /* 0 if none */
+static uint32_t fil_au_sectors;       /* 0 if unknown */
 static struct fil cwd;
 
 #define CLUSTER_MASK 0x0fffffff
@@ -139,20 +141,23 @@ static uint32_t * fat(uint32_t cluster)
 }
 
 static er_t cwd_init(uint32_t head);
+static er_t extents_build(void);
+static er_t fsinfo_read(void);
+static void au_init(void);
 
 er_t fil_init(void)
 {
   uint16_t us;
   er_t er;
-  uint32_t dev_start, dev_nr_sectors;
+  uint32_t dev_start, dev_nr_sectors, nr_sectors;
   uint16_t nr_reserved_sectors;
 
   dbg(tx_puts("fil_init:calling fil_reinit()...\r\n"));
   er = fil_reinit();
   if (er) return(er);
 
-  dbg(tx_puts("fil_init:calling sd_bread(0)...\r\n"));
-  er = sd_bread(0);
+  dbg(tx_puts("fil_init:calling sd_buffer_checkout(0)...\r\n"));
+  er = sd_buffer_checkout(0);
   if (er) return(er);
 
   dbg(tx_puts("fil_init:calling checksig()...\r\n"));
@@ -168,7 +173,7 @@ er_t fil_init(void)
   COPY4(dev_start, sd_buffer + 446 + 8);
   COPY4(dev_nr_sectors, sd_buffer + 446 + 12);
 
-  er = sd_bread(dev_start);
+  er = sd_buffer_checkout(dev_start);
   if (er) return(er);
 
   if (checksig()) return(fail(FIL_EBOOTSIG));
@@ -186,6 +191,7 @@ er_t fil_init(void)
   fil_nr_fats = sd_buffer[0x10];
   if (fil_nr_fats != 2) return(fail(FIL_ENRFATS));
 
+  COPY4(nr_sectors, sd_buffer + 0x20);
   COPY4(fil_sectors_per_fat, sd_buffer + 0x24);
   COPY4(fil_root_dir_1st_cluster, sd_buffer + 0x2c);
   fil_cwd_1st_cluster = fil_root_dir_1st_cluster;
@@ -195,6 +201,12 @@ er_t fil_init(void)
   fil_clusters_start = fil_fat_start +
     (fil_nr_fats * fil_sectors_per_fat);
   fil_last_cluster_number = (fil_sectors_per_fat * 128) - 1;
+  /* The FAT is usually padded beyond the last data cluster */
+  nr_sectors -= fil_clusters_start - dev_start;
+  if (nr_sectors/fil_sectors_per_cluster + 1 < fil_last_cluster_number)
+    fil_last_cluster_number = nr_sectors/fil_sectors_per_cluster + 1;
+  COPY2(us, sd_buffer + 0x30);
+  fil_fsinfo_sector = (us && us < nr_reserved_sectors)? dev_start + us: 0;
   dbg(tx_msg("bpb[0x25] = ", sd_buffer[0x25]));
   dbg(tx_msg("bpb[0x41] = ", sd_buffer[0x41]));
 
@@ -210,7 +222,15 @@ er_t fil_init(void)
   }
 #endif
 
-  return(cwd_init(fil_root_dir_1st_cluster));
+  if (sd_au_sectors(&fil_au_sectors)) fil_au_sectors = 0;
+  dbg_print32("fil_init:au_sectors", fil_au_sectors);
+  au_init();
+
+  er = fsinfo_read();
+  if (er) return(er);
+  er = cwd_init(fil_root_dir_1st_cluster);
+  if (er) return(er);
+  return(extents_build());
 }
 
 static uint32_t fat_cdr(uint32_t cluster)
@@ -221,35 +241,535 @@ static uint32_t fat_cdr(uint32_t cluster)
   return(*p);
 }
 
+/*
+  Long scans of the FAT (free space, chain walks) read it with one
+  CMD18 stream into a scratch sd_buffer, rather than a CMD17 per
+  sector.  Only forward motion is streamed, going backwards or
+  far ahead restarts the stream.  Nothing else may use the card
+  or sd_buffer until fat_stream_end().
+ */
+#define FAT_STREAM_SKIP 8
+static uint32_t stream_sector = SD_ADDRESS_NONE;
+static uint32_t * fat_stream(uint32_t cluster)
+{
+  uint32_t sector;
+
+  cluster &= CLUSTER_MASK;
+  if (cluster > fil_last_cluster_number) {
+    fat_er = FIL_ERANGE;
+    return(0);
+  }
+  sector = fil_fat_start + cluster/128;
+  if (SD_ADDRESS_NONE == stream_sector
+    || sector < stream_sector
+    || sector > stream_sector + FAT_STREAM_SKIP) {
+    if (SD_ADDRESS_NONE == stream_sector) {
+      fat_er = sd_buffer_sync();      /* card must be up to date */
+      if (!fat_er)
+        fat_er = sd_buffer_checkout(SD_ADDRESS_NONE);
+    } else {
+      stream_sector = SD_ADDRESS_NONE;
+      fat_er = sd_breads_end();
+    }
+    if (fat_er) return(0);
+    fat_er = sd_breads_begin(sector);
+    if (fat_er) return(0);
+    stream_sector = sector - 1;
+  }
+  for ( ; stream_sector < sector; stream_sector++) {
+    fat_er = sd_breads(sd_buffer);
+    if (fat_er) return(0);
+  }
+  return((uint32_t *)sd_buffer + cluster % 128);
+}
+
+static er_t fat_stream_end(void)
+{
+  if (SD_ADDRESS_NONE == stream_sector) return(0);
+  stream_sector = SD_ADDRESS_NONE;
+  return(sd_breads_end());
+}
+
+/*
+  Follow the chain from *tailp to its last cluster, which is left
+  in *tailp, with *nrp the number of clusters after the first.
+  More than max is FIL_ELOOP.
+ */
+static er_t fat_chain_walk(uint32_t * tailp, uint32_t * nrp, uint32_t max)
+{
+  uint32_t * p, next;
+  er_t er;
+
+  for (*nrp = 0; ; (*nrp)++) {
+    if (*nrp > max) {
+      er = FIL_ELOOP;
+      break;
+    }
+    p = fat_stream(*tailp);
+    if (!p) {
+      er = fat_er;
+      break;
+    }
+    next = *p;
+    if (!next) {
+      dbg_print32("Chain ends in 0, not CHAIN_END, cluster", *tailp);
+      er = FIL_ECHAIN;
+      break;
+    }
+    if (IS_EOC(next)) {
+      return(fat_stream_end());
+    }
+    *tailp = next;
+  }
+  (void)fat_stream_end();
+  return(er);
+}
+
+/*
+  FAT2 is only brought into line with FAT1 by fil_sync_fat2(),
+  not on every change.  Sectors of FAT1 changed one entry at a
+  time are noted by fat_dirty() and later copied across.  Runs
+  written whole by fat_chain_run() are queued and written whole
+  again.  A full queue is flushed there and then.
+ */
+#define FAT2_NR_SECTORS 8
+#define FAT2_NR_RUNS 2
+static uint32_t fat2_sectors[FAT2_NR_SECTORS];
+static uint8_t nr_fat2_sectors;
+static struct { uint32_t lo, hi, last; } fat2_runs[FAT2_NR_RUNS];
+static uint8_t nr_fat2_runs;
+
+/*
+  Write FAT sectors lo..hi-1 (relative to base), all of whose
+  entries belong to a contiguous chain ending at cluster last, in
+  one multi-block write.
+ */
+static er_t fat_write_sectors(uint32_t base,
+  uint32_t lo, uint32_t hi, uint32_t last)
+{
+  uint32_t cluster, * p;
+  uint8_t i;
+  er_t er;
+
+  er = sd_buffer_checkout(SD_ADDRESS_NONE);
+  if (er) return(er);
+  er = sd_bwrites_begin(base + lo, hi - lo);
+  if (er) return(er);
+  for (cluster = lo*128; lo < hi; lo++) {
+    p = (uint32_t *)sd_buffer;
+    for (i = 0; i < 128; i++, cluster++)
+      p[i] = (cluster == last ? CHAIN_END : cluster + 1);
+    er = sd_bwrites(sd_buffer, 512);
+    if (er) return(er);
+  }
+  return(sd_bwrites_end());
+}
+
+er_t fil_sync_fat2(void)
+{
+  uint32_t fat2;
+  uint8_t i;
+  er_t er;
+
+  fat2 = fil_fat_start + fil_sectors_per_fat;
+  for (i = 0; i < nr_fat2_runs; i++) {
+    er = fat_write_sectors(fat2,
+      fat2_runs[i].lo, fat2_runs[i].hi, fat2_runs[i].last);
+    if (er) return(er);
+  }
+  nr_fat2_runs = 0;
+  for (i = 0; i < nr_fat2_sectors; i++) {
+    er = sd_buffer_checkout(fil_fat_start + fat2_sectors[i]);
+    if (er) return(er);
+    er = sd_bwrite(fat2 + fat2_sectors[i]);
+    if (er) return(er);
+  }
+  nr_fat2_sectors = 0;
+  return(0);
+}
+
+/*
+  Call after changing the FAT entry for cluster in sd_buffer.
+  May use sd_buffer to flush FAT2.
+ */
+static er_t fat_dirty(uint32_t cluster)
+{
+  uint32_t sector;
+  uint8_t i;
+
+  sd_buffer_dirty();
+  sector = (cluster & CLUSTER_MASK)/128;
+  for (i = 0; i < nr_fat2_sectors; i++)
+    if (fat2_sectors[i] == sector) return(0);
+  if (FAT2_NR_SECTORS == nr_fat2_sectors) {
+    er_t er;
+    er = fil_sync_fat2();
+    if (er) return(er);
+  }
+  fat2_sectors[nr_fat2_sectors++] = sector;
+  return(0);
+}
+
+/*
+  Chain nr free clusters from first.  Whole FAT sectors are
+  written in one go without being read, the partial sectors at
+  either end go through the sector cache.
+ */
+static er_t fat_chain_run(uint32_t first, uint32_t nr)
+{
+  uint32_t cluster, last, lo, hi, * p;
+  er_t er;
+
+  last = first + nr - 1;
+  lo = (first + 127)/128;             /* first whole sector */
+  hi = (last + 1)/128;                /* after last whole sector */
+  if (lo < hi) {
+    sd_buffer_discard(fil_fat_start + lo, hi - lo);
+    er = fat_write_sectors(fil_fat_start, lo, hi, last);
+    if (er) return(er);
+    if (FAT2_NR_RUNS == nr_fat2_runs) {
+      er = fil_sync_fat2();
+      if (er) return(er);
+    }
+    fat2_runs[nr_fat2_runs].lo = lo;
+    fat2_runs[nr_fat2_runs].hi = hi;
+    fat2_runs[nr_fat2_runs].last = last;
+    nr_fat2_runs++;
+  }
+  for (cluster = first; cluster <= last; cluster++) {
+    if (cluster/128 >= lo && cluster/128 < hi) {
+      cluster = hi*128 - 1;           /* already done */
+      continue;
+    }
+    p = fat(cluster);
+    if (!p) return(fat_er);
+    *p = (cluster == last ? CHAIN_END : cluster + 1);
+    er = fat_dirty(cluster);
+    if (er) return(er);
+  }
+  return(0);
+}
+
+/*
+  FSInfo sector: count of free clusters and where to start
+  looking for one, so a boot need not scan the whole FAT to know
+  either.  Kept up to date in RAM by fsinfo_allocated(), written
+  back by fil_sync_fsinfo().
+ */
+#define FSINFO_UNKNOWN 0xffffffff
+static uint32_t free_count = FSINFO_UNKNOWN;
 static uint32_t free_cluster_hint;
-static uint32_t fat_find_free_cluster(void)
+static bool fsinfo_dirty;
+
+static er_t fsinfo_read(void)
+{
+  uint32_t u;
+  er_t er;
+
+  free_count = FSINFO_UNKNOWN;
+  free_cluster_hint = 0;
+  fsinfo_dirty = false;
+  if (!fil_fsinfo_sector) return(0);
+  er = sd_buffer_checkout(fil_fsinfo_sector);
+  if (er) return(er);
+  COPY4(u, sd_buffer);
+  if (u != 0x41615252) goto invalid;
+  COPY4(u, sd_buffer + 484);
+  if (u != 0x61417272) goto invalid;
+  COPY4(u, sd_buffer + 508);
+  if (u != 0xaa550000) goto invalid;
+
+  COPY4(u, sd_buffer + 488);
+  if (u <= fil_last_cluster_number - 1)
+    free_count = u;
+  COPY4(u, sd_buffer + 492);
+  if (u >= 2 && u <= fil_last_cluster_number)
+    free_cluster_hint = u;
+  dbg_print32("fsinfo:free_count", free_count);
+  dbg_print32("fsinfo:next_free", free_cluster_hint);
+  return(0);
+invalid:
+  dbg(tx_puts("fsinfo:bad signature\r\n"));
+  fil_fsinfo_sector = 0;
+  return(0);
+}
+
+static void fsinfo_allocated(uint32_t cluster, uint32_t nr)
+{
+  if (free_count != FSINFO_UNKNOWN)
+    free_count = (free_count > nr ? free_count - nr : 0);
+  if (cluster + nr > free_cluster_hint)
+    free_cluster_hint = cluster + nr;
+  fsinfo_dirty = true;
+}
+
+er_t fil_sync_fsinfo(void)
+{
+  er_t er;
+
+  if (!fsinfo_dirty || !fil_fsinfo_sector) return(0);
+  er = sd_buffer_checkout(fil_fsinfo_sector);
+  if (er) return(er);
+  memcpy(sd_buffer + 488, &free_count, 4);
+  memcpy(sd_buffer + 492, &free_cluster_hint, 4);
+  sd_buffer_dirty();
+  fsinfo_dirty = false;
+  return(sd_buffer_sync());
+}
+
+uint32_t fil_free_kbytes(void)
 {
+  if (FSINFO_UNKNOWN == free_count) return(FSINFO_UNKNOWN);
+  return(free_count * (fil_sectors_per_cluster/2));
+}
+
+/*
+  Free space index: the largest runs of free clusters, found by
+  one pass over the FAT in fil_init().  Allocation takes the
+  smallest run that fits, so single clusters (log, directories)
+  come out of small holes, leaving the long runs for recordings.
+  If there were more runs than FIL_NR_EXTENTS, the smallest were
+  forgotten, extents_partial is set, and when nothing in the
+  index fits, the FAT is scanned as before.
+  With a good FSInfo, only the FAT from its next free cluster on
+  is scanned, trusting that what comes before is (mostly) full,
+  unless less than half the free count turns up there.
+  Otherwise the scan counts the free clusters for FSInfo.
+ */
+#ifndef FIL_NR_EXTENTS
+#define FIL_NR_EXTENTS 16
+#endif
+static struct { uint32_t start, len; } extents[FIL_NR_EXTENTS];
+static uint8_t nr_extents;
+static bool extents_valid, extents_partial;
+
+static void extent_add(uint32_t start, uint32_t len)
+{
+  uint8_t i, min;
+
+  if (nr_extents < FIL_NR_EXTENTS) {
+    i = nr_extents++;
+  } else {
+    extents_partial = true;
+    for (min = 0, i = 1; i < FIL_NR_EXTENTS; i++)
+      if (extents[i].len < extents[min].len) min = i;
+    if (len <= extents[min].len) return;
+    i = min;
+  }
+  extents[i].start = start;
+  extents[i].len = len;
+}
+
+static er_t extents_build(void)
+{
+  uint32_t from, cluster, start, first, counted, * p;
+  er_t er;
+
+  from = 2;
+  if (free_count != FSINFO_UNKNOWN && free_cluster_hint)
+    from = free_cluster_hint;
+rescan:
+  nr_extents = 0;
+  extents_valid = false;
+  extents_partial = (from > 2);
+  start = first = counted = 0;
+  for (cluster = from; cluster <= fil_last_cluster_number; cluster++) {
+    p = fat_stream(cluster);
+    if (!p) {
+      (void)fat_stream_end();
+      return(fat_er);
+    }
+    if (!*p) {
+      counted++;
+      if (!first) first = cluster;
+      if (!start) start = cluster;
+    } else if (start) {
+      extent_add(start, cluster - start);
+      start = 0;
+    }
+  }
+  if (start) extent_add(start, cluster - start);
+  er = fat_stream_end();
+  if (er) return(er);
+  /*
+    If much of the free space is not after the hint, the hint is
+    wrong (another OS, or an older version of this code, moved it)
+    and the index would miss most of the holes.
+   */
+  if (from > 2 && counted < free_count/2) {
+    dbg(tx_msg("extents_build:rescan, counted ", counted));
+    from = 2;
+    goto rescan;
+  }
+  extents_valid = true;
+  if (first) free_cluster_hint = first;
+  if ((!extents_partial && counted != free_count)
+    || FSINFO_UNKNOWN == free_count || counted > free_count) {
+    free_count = counted;
+    fsinfo_dirty = true;
+  }
+  dbg(tx_msg("extents_build:nr_extents=", nr_extents));
+  dbg(tx_msg("extents_build:partial=", extents_partial));
+  return(0);
+}
+
+/*
+  Returns the first of nr free clusters, now removed from the
+  index, or 0 if none in the index.
+ */
+static uint32_t extent_take(uint32_t nr)
+{
+  uint8_t i, best;
   uint32_t cluster;
 
-  if (!free_cluster_hint)
-    free_cluster_hint = 2;
+  if (!extents_valid) return(0);
+  best = nr_extents;
+  for (i = 0; i < nr_extents; i++) {
+    if (extents[i].len < nr) continue;
+    if (best == nr_extents || extents[i].len < extents[best].len)
+      best = i;
+  }
+  if (best == nr_extents) return(0);
+  cluster = extents[best].start;
+  extents[best].start += nr;
+  extents[best].len -= nr;
+  if (!extents[best].len)
+    extents[best] = extents[--nr_extents];
+  return(cluster);
+}
 
-  for ( ; ; free_cluster_hint++) {
-    uint32_t * p;
-    if (free_cluster_hint > fil_last_cluster_number) {
-      fat_er = FIL_ENOSPC;
-      return(0);
+/*
+  SD cards write fastest, with the fewest long busy periods, when
+  a multi-block write starts on an allocation unit (AU) boundary.
+  au_first is the first cluster on one, every au_clusters after
+  is another.  au_clusters is 0 if not aligning.
+ */
+#ifndef FIL_AU_ALIGN
+#define FIL_AU_ALIGN 1
+#endif
+static uint32_t au_first, au_clusters;
+static void au_init(void)
+{
+  uint32_t cluster, n;
+
+  au_clusters = 0;
+  if (!FIL_AU_ALIGN) return;
+  if (fil_au_sectors <= fil_sectors_per_cluster) return;
+  if (fil_au_sectors % fil_sectors_per_cluster) return;
+  n = fil_au_sectors/fil_sectors_per_cluster;
+  for (cluster = 2; cluster < 2 + n; cluster++) {
+    if (!(fil_sector_address(cluster) % fil_au_sectors)) {
+      au_first = cluster;
+      au_clusters = n;
+      return;
+    }
+  }
+}
+
+uint32_t fil_au_kbytes(void) { return(fil_au_sectors/2); }
+
+/*
+  As extent_take(), but the run starts on an AU boundary.  What is
+  left before and after it stay in the index.
+ */
+static uint32_t extent_take_aligned(uint32_t nr)
+{
+  uint8_t i, best;
+  uint32_t cluster, end, best_cluster;
+
+  if (!extents_valid || !au_clusters) return(0);
+  best = nr_extents;
+  best_cluster = 0;
+  for (i = 0; i < nr_extents; i++) {
+    cluster = extents[i].start;
+    if (cluster < au_first) cluster = au_first;
+    cluster += (au_clusters - (cluster - au_first) % au_clusters)
+      % au_clusters;
+    end = extents[i].start + extents[i].len;
+    if (cluster >= end || end - cluster < nr) continue;
+    if (best == nr_extents || extents[i].len < extents[best].len) {
+      best = i;
+      best_cluster = cluster;
     }
-    p = fat(free_cluster_hint);
+  }
+  if (best == nr_extents) return(0);
+  end = extents[best].start + extents[best].len;
+  if (best_cluster > extents[best].start)
+    extents[best].len = best_cluster - extents[best].start;
+  else
+    extents[best] = extents[--nr_extents];
+  if (end > best_cluster + nr)
+    extent_add(best_cluster + nr, end - (best_cluster + nr));
+  return(best_cluster);
+}
+
+/* Nothing in the index fits: is there any point scanning the FAT? */
+static bool extents_exhaustive(void)
+{
+  return(extents_valid && !extents_partial);
+}
+
+static uint32_t fat_find_free_cluster(void)
+{
+  uint32_t cluster, * p;
+
+  cluster = extent_take(1);
+  if (cluster) {
+    p = fat(cluster);
     if (!p) return(0);
-    if (*p) continue;
-    *p = CHAIN_END;
-    break;
+    if (!*p) {
+      *p = CHAIN_END;
+      fat_er = fat_dirty(cluster);
+      if (fat_er) return(0);
+      fsinfo_allocated(cluster, 1);
+      return(cluster);
+    }
+    extents_valid = false;            /* index is wrong, don't use */
+  } else if (extents_exhaustive()) {
+    fat_er = FIL_ENOSPC;
+    return(0);
   }
-  cluster = free_cluster_hint;
-  free_cluster_hint++;
+
+  /* Usually the hint is free, else stream the FAT to find one */
+  cluster = (free_cluster_hint ? free_cluster_hint : 2);
+  if (cluster > fil_last_cluster_number) {
+    fat_er = FIL_ENOSPC;
+    return(0);
+  }
+  p = fat(cluster);
+  if (!p) return(0);
+  if (*p) {
+    for ( ; ; ) {
+      if (++cluster > fil_last_cluster_number) {
+        (void)fat_stream_end();
+        fat_er = FIL_ENOSPC;
+        return(0);
+      }
+      p = fat_stream(cluster);
+      if (!p) {
+        (void)fat_stream_end();
+        return(0);
+      }
+      if (!*p) break;
+    }
+    fat_er = fat_stream_end();
+    if (fat_er) return(0);
+    p = fat(cluster);
+    if (!p) return(0);
+  }
+  *p = CHAIN_END;
+  fat_er = fat_dirty(cluster);
+  if (fat_er) return(0);
+  fsinfo_allocated(cluster, 1);
   return(cluster);
 }
 
 int8_t fil_approx_sd_used_pct(void)
 {
-  return(fil_last_cluster_number?
-    (100UL*free_cluster_hint)/fil_last_cluster_number:0);
+  if (!fil_last_cluster_number) return(0);
+  if (FSINFO_UNKNOWN == free_count)
+    return((100UL*free_cluster_hint)/fil_last_cluster_number);
+  return(100 - (100UL*free_count)/(fil_last_cluster_number - 1));
 }
 
 uint32_t fil_sector_address(uint32_t cluster_number)
@@ -264,9 +784,10 @@ uint32_t fil_sector_address(uint32_t cluster_number)
 
 er_t fil_find_free_clusters(uint32_t kbytes, uint32_t * clustp)
 {
-  uint32_t nr, nr_clusters, cluster;
+  uint32_t nr, nr_clusters, cluster, next;
   uint16_t kbytes_per_cluster;
   uint32_t * p;
+  er_t er;
 
   {
     ldiv_t d;
@@ -278,35 +799,46 @@ er_t fil_find_free_clusters(uint32_t kbytes, uint32_t * clustp)
 
   dbg(tx_msg("fil_find_free_clusters: nr_clusters = ", nr_clusters));
 
-  if (!free_cluster_hint)
-    free_cluster_hint = 2;
+  cluster = extent_take_aligned(nr_clusters);
+  if (!cluster) cluster = extent_take(nr_clusters);
+  if (cluster) goto found;
+  if (extents_exhaustive()) return(FIL_ENOSPC);
 
+  /*
+    Scan with a cursor of our own: if there is no run long enough,
+    the hint is still where the free space starts.
+   */
+  next = (free_cluster_hint ? free_cluster_hint : 2);
   cluster = 0;                        /* Shut up compiler */
-  for (nr = 0; ; free_cluster_hint++) {
-    if (free_cluster_hint >= fil_last_cluster_number)
+  for (nr = 0; ; next++) {
+    if (next >= fil_last_cluster_number) {
+      (void)fat_stream_end();
       return(FIL_ENOSPC);
-    p = fat(free_cluster_hint);
-    if (!p) return(fat_er);
+    }
+    p = fat_stream(next);
+    if (!p) {
+      (void)fat_stream_end();
+      return(fat_er);
+    }
     if (*p) {                         /* cluster in use */
       nr = 0;
     } else {                          /* free cluster */
-      if (!nr) cluster = free_cluster_hint;
+      if (!nr) cluster = next;
       nr++;
       if (nr == nr_clusters) break;
     }
   }
+  er = fat_stream_end();
+  if (er) return(er);
 
+found:
   *clustp = cluster;                  /* will be start of file */
+  fsinfo_allocated(cluster, nr_clusters);
 
-  /* Chain clusters together */
-  for (nr = 0; nr < nr_clusters-1; nr++) {
-    p = fat(cluster);
-    cluster++;
-    *p = cluster;
-  }
-  dbg_print32("fil_find_free_clusters:last cluster", cluster);
-  p = fat(cluster);
-  *p = CHAIN_END;
+  er = fat_chain_run(cluster, nr_clusters);
+  if (er) return(er);
+  dbg_print32("fil_find_free_clusters:last cluster",
+    cluster + nr_clusters - 1);
   sd_buffer_sync();
 
 #if 0 /* DBG_FIL */ /* too much output, and slow XXX */
@@ -330,6 +862,85 @@ er_t fil_find_free_clusters(uint32_t kbytes, uint32_t * clustp)
   return(0);
 }
 
+/*
+  If there is no single run, take the longest runs in the free
+  space index until there is enough, shortening the last.  Runs
+  shorter than FIL_MIN_RUN_KBYTES are not used: each costs the
+  writer a stop and restart.
+ */
+#ifndef FIL_MIN_RUN_KBYTES
+#define FIL_MIN_RUN_KBYTES 256
+#endif
+er_t fil_find_free_runs(uint32_t kbytes,
+  struct fil_run * runs, uint8_t * nrp)
+{
+  uint32_t nr_clusters, min, nr, last, * p;
+  uint8_t i, j, max, best;
+  er_t er;
+
+  max = *nrp;
+  *nrp = 0;
+  if (!max) return(FIL_ERANGE);
+  nr_clusters = (kbytes*2 + fil_sectors_per_cluster - 1)/
+    fil_sectors_per_cluster;
+
+  er = fil_find_free_clusters(kbytes, &runs[0].cluster);
+  if (!er) {
+    runs[0].nr_sectors = nr_clusters*fil_sectors_per_cluster;
+    *nrp = 1;
+    return(0);
+  }
+  if (FIL_ENOSPC != er || 1 == max) return(er);
+
+  if (!extents_valid) {
+    er = extents_build();
+    if (er) return(er);
+  }
+  min = (FIL_MIN_RUN_KBYTES*2)/fil_sectors_per_cluster;
+  if (!min) min = 1;
+  for (i = 0; i < max && nr_clusters; i++) {
+    best = nr_extents;
+    for (j = 0; j < nr_extents; j++) {
+      if (extents[j].len < min) continue;
+      if (best == nr_extents || extents[j].len > extents[best].len)
+        best = j;
+    }
+    if (best == nr_extents) break;
+    nr = extents[best].len;
+    if (nr > nr_clusters) nr = nr_clusters;
+    runs[i].cluster = extents[best].start;
+    runs[i].nr_sectors = nr*fil_sectors_per_cluster;
+    extents[best].start += nr;
+    extents[best].len -= nr;
+    if (!extents[best].len)
+      extents[best] = extents[--nr_extents];
+    nr_clusters -= nr;
+  }
+  if (nr_clusters) {                  /* not enough, put them back */
+    while (i--)
+      extent_add(runs[i].cluster,
+        runs[i].nr_sectors/fil_sectors_per_cluster);
+    return(FIL_ENOSPC);
+  }
+  dbg(tx_msg("fil_find_free_runs:nr runs = ", i));
+
+  for (j = 0; j < i; j++) {
+    nr = runs[j].nr_sectors/fil_sectors_per_cluster;
+    fsinfo_allocated(runs[j].cluster, nr);
+    er = fat_chain_run(runs[j].cluster, nr);
+    if (er) return(er);
+    if (j + 1 == i) break;
+    last = runs[j].cluster + nr - 1;  /* link to the next run */
+    p = fat(last);
+    if (!p) return(fat_er);
+    *p = runs[j + 1].cluster;
+    er = fat_dirty(last);
+    if (er) return(er);
+  }
+  *nrp = i;
+  return(sd_buffer_sync());
+}
+
 static uint32_t fat_chain_grow(uint32_t tail)
 {
   uint32_t * p;
@@ -337,21 +948,20 @@ static uint32_t fat_chain_grow(uint32_t tail)
 
   cluster = fat_find_free_cluster();
   if (!cluster) return(0);
-  p = fat(cluster);
-  if (!p) return(0);
-  *p = CHAIN_END;
-
   if (tail) {
     p = fat(tail);
     if (!p) return(0);
     *p = cluster;
+    fat_er = fat_dirty(tail);
+    if (fat_er) return(0);
   }
   return(cluster);
 }
 
 static er_t cwd_init(uint32_t head)
 {
-  uint8_t i;
+  uint32_t nr;
+  er_t er;
 
   if (!head)
     head = fil_root_dir_1st_cluster;
@@ -360,16 +970,10 @@ static er_t cwd_init(uint32_t head)
   cwd.tail = cwd.head = head;
   cwd.file_size = fil_bytes_per_cluster;
 
-  for (i = 0; ; i++) {
-    uint32_t next;
-    if (i > 100) return(FIL_ELOOP);
-    dbg_print32("cwd_init:current cluster", cwd.tail);
-    next = fat_cdr(cwd.tail);
-    if (!next) return(fat_er);
-    if (IS_EOC(next)) break;
-    cwd.tail = next;
-    cwd.file_size += fil_bytes_per_cluster;
-  }
+  er = fat_chain_walk(&cwd.tail, &nr, 100);
+  if (er) return(er);
+  cwd.file_size += nr * fil_bytes_per_cluster;
+  dbg_print32("cwd_init:last cluster", cwd.tail);
   return(0);
 }
 
@@ -490,12 +1094,9 @@ found:
   fp->attributes = dp->attr;
 
   fp->tail = fp->head;
-  while (fp->tail) {
-    uint32_t next;
-    next = fat_cdr(fp->tail);
-    if (!next) return(fat_er);
-    if (IS_EOC(next)) break;
-    fp->tail = next;
+  if (fp->tail) {
+    uint32_t nr;
+    return(fat_chain_walk(&fp->tail, &nr, fil_last_cluster_number));
   }
   return(0);
 }
@@ -538,6 +1139,7 @@ er_t fil_save_dirent(struct fil * fp, char fn[11], bool flag_sync)
   memcpy(&dp->wdate, &fp->wdate, 2);
   memcpy(&dp->ctime, &fp->wtime, 2);
   memcpy(&dp->wtime, &fp->wtime, 2);
+  sd_buffer_dirty();
   return(flag_sync?sd_buffer_sync():0);
 }
 
@@ -573,6 +1175,7 @@ er_t fil_append(struct fil * fp, uint8_t * buf, uint16_t len)
     if (len > avail) count = avail;
     else count = len;
     memcpy(sd_buffer + used, buf, count);
+    sd_buffer_dirty();
     fp->file_size += count;
     len -= count;
     buf += count;
@@ -701,6 +1304,7 @@ create_file:
       lp->attr = FIL_ATTR_LFN;
       lp->ord =                       /* min value is 1, not 0 */
         (nr_slots_reqd - 1) - i;
+      sd_buffer_dirty();
     }
     lp->ord |= 0x40;
   }
@@ -769,5 +1373,6 @@ er_t fil_mkdir(char fn[11], char lfn[11], struct fil * fp)
   dbg(tx_msg("\"..\" clust1lo = ", dp[1].clust1lo));
   dp[1].clust1hi = head >> 16;
   dbg(tx_msg("\"..\" clust1hi = ", dp[1].clust1hi));
+  sd_buffer_dirty();
   return(fil_save_dirent(fp, 0, true));
 }
@@ -87,10 +87,34 @@ extern er_t fil_init(void);
 
 extern int8_t fil_approx_sd_used_pct(void);
 
+/* Free space per FSInfo (kept up to date), or 0xffffffff if unknown */
+extern uint32_t fil_free_kbytes(void);
+
+/* Card's allocation unit, recordings start on one if possible */
+extern uint32_t fil_au_kbytes(void);
+
+/* Bring the second FAT up to date with the first */
+extern er_t fil_sync_fat2(void);
+
+/* Write free count and next free cluster back to FSInfo */
+extern er_t fil_sync_fsinfo(void);
+
 extern uint32_t fil_sector_address(uint32_t cluster_number);
 
 extern er_t fil_find_free_clusters(uint32_t kbytes, uint32_t * addr);
 
+/*
+  A file of up to *nrp runs of contiguous clusters, chained one to
+  the next, for when no single run is long enough.  *nrp is
+  updated with the number of runs used.
+ */
+struct fil_run {
+  uint32_t cluster;                   /* first */
+  uint32_t nr_sectors;                /* whole clusters */
+};
+extern er_t fil_find_free_runs(uint32_t kbytes,
+  struct fil_run * runs, uint8_t * nrp);
+
 extern er_t fil_seek(struct fil * fp, uint32_t offset);
 
 extern er_t fil_seek_next(struct fil * fp);
@@ -0,0 +1,127 @@
+/*
+  Copyright 2020 Harold Tay GPLv3
+  Host benchmark and check of fmt.c's decimal conversion.
+
+  The old fmt_u32d() did d%10 and d/10 per digit.  On the M0
+  each of those is a call to libgcc's __aeabi_uidiv(mod), a shift
+  and subtract loop, whereas on the host the compiler turns /10
+  into a multiply.  So the old version here divides with
+  udivmod(), a restoring divide as on the M0, to compare like
+  with like.  Times are host cycles (rdtsc) or ns.
+
+  Usage: fmt-bench [nr_conversions]
+ */
+#define _XOPEN_SOURCE 700
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fmt.h"
+
+static uint32_t udivmod(uint32_t n, uint32_t d, uint32_t * remp)
+  __attribute__((noinline));
+static uint32_t udivmod(uint32_t n, uint32_t d, uint32_t * remp)
+{
+  uint32_t q, r;
+  int i;
+  for (q = r = 0, i = 31; i >= 0; i--) {
+    r = (r << 1) | ((n >> i) & 1);
+    if (r >= d) {
+      r -= d;
+      q |= 1UL << i;
+    }
+  }
+  *remp = r;
+  return(q);
+}
+
+static char * old_u32d(uint32_t d, char buf[FMT_BUFSZ])
+{
+  uint32_t r;
+  uint8_t i;
+  i = FMT_BUFSZ - 1;
+  buf[i] = '\0';
+  do {
+    (void)udivmod(d, 10, &r);         /* d%10 */
+    buf[--i] = '0' + r;
+    d = udivmod(d, 10, &r);           /* d /= 10 */
+  } while (d);
+  return(buf + i);
+}
+
+static uint64_t now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return(__builtin_ia32_rdtsc());
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+static uint32_t rnd(void)
+{
+  static uint32_t x = 2463534242UL;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return(x);
+}
+
+static int check(uint32_t d)
+{
+  char buf[FMT_BUFSZ], ref[24];
+  snprintf(ref, sizeof(ref), "%lu", (unsigned long)d);
+  if (strcmp(fmt_u32d_r(d, buf), ref)) {
+    printf("fmt_u32d_r(%s) gave %s\n", ref, fmt_u32d_r(d, buf));
+    return(-1);
+  }
+  snprintf(ref, sizeof(ref), "%ld", (long)(int32_t)d);
+  if (strcmp(fmt_i32d_r((int32_t)d, buf), ref)) {
+    printf("fmt_i32d_r(%s) gave %s\n", ref, fmt_i32d_r((int32_t)d, buf));
+    return(-1);
+  }
+  return(0);
+}
+
+int main(int argc, char ** argv)
+{
+  static uint32_t vals[4096];
+  char buf[FMT_BUFSZ];
+  uint64_t t, told, tnew;
+  uint32_t i, n, sum;
+
+  n = argc > 1 ? strtoul(argv[1], 0, 0) : 4000000;
+
+  /* Every value to 2^24, powers of ten +-1, and random */
+  for (i = 0; i < (1UL << 24); i++)
+    if (check(i)) return(1);
+  for (t = 1; t <= 0xffffffffULL; t *= 10)
+    if (check(t - 1) || check(t) || check(t + 1)) return(1);
+  if (check(0xffffffff) || check(0x80000000)) return(1);
+  for (i = 0; i < 10000000; i++)
+    if (check(rnd())) return(1);
+  printf("fmt_u32d_r and fmt_i32d_r agree with printf\n");
+
+  for (i = 0; i < 4096; i++)          /* mixed lengths, as in logs */
+    vals[i] = rnd() >> (rnd() % 32);
+
+  sum = 0;
+  t = now();
+  for (i = 0; i < n; i++)
+    sum += *old_u32d(vals[i % 4096], buf);
+  told = now() - t;
+  t = now();
+  for (i = 0; i < n; i++)
+    sum += *fmt_u32d_r(vals[i % 4096], buf);
+  tnew = now() - t;
+
+  printf("%s per conversion: divide %.1f, divide-free %.1f (%u)\n",
+#if defined(__x86_64__) || defined(__i386__)
+    "cycles",
+#else
+    "ns",
+#endif
+    (double)told/n, (double)tnew/n, sum & 1);
+  return(0);
+}
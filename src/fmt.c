@@ -11,7 +11,7 @@
 #endif
 #include "fmt.h"
 
-char fmt_buf[12];
+char fmt_buf[FMT_BUFSZ];
 
 #ifdef FMT_DEBUG
 static void init_buf(void)
@@ -24,43 +24,59 @@ static void init_buf(void)
 #else
 #define init_buf() fmt_buf[sizeof(fmt_buf)-1] = '\0'
 #endif
-char * fmt_u32d(uint32_t d)
+
+/*
+  d/10 by shifts and adds (Hacker's Delight, divu10): q is within
+  one of the quotient, and the remainder puts it right.
+ */
+static uint32_t div10(uint32_t d, uint8_t * remp)
 {
-  uint8_t i;
-  init_buf();
-  i = sizeof(fmt_buf) - 1;
-  do fmt_buf[--i] = '0' + (d%10); while( (d /= 10) );
-  return(fmt_buf + i);
+  uint32_t q, r;
+  q = (d >> 1) + (d >> 2);
+  q += q >> 4;
+  q += q >> 8;
+  q += q >> 16;
+  q >>= 3;
+  r = d - (((q << 2) + q) << 1);
+  if (r > 9) {
+    q++;
+    r -= 10;
+  }
+  *remp = r;
+  return(q);
+}
+
+char * fmt_u32d_r(uint32_t d, char buf[FMT_BUFSZ])
+{
+  uint8_t i, r;
+  i = FMT_BUFSZ - 1;
+  buf[i] = '\0';
+  do {
+    d = div10(d, &r);
+    buf[--i] = '0' + r;
+  } while (d);
+  return(buf + i);
 }
 
-char * fmt_i32d(int32_t d)
+char * fmt_i32d_r(int32_t d, char buf[FMT_BUFSZ])
 {
   if( d < 0 ){
     char * p;
-    p = fmt_u32d(0 - d);
+    p = fmt_u32d_r(0 - (uint32_t)d, buf);
     *(--p) = '-';
     return(p);
   }else
-    return(fmt_u32d(d));
+    return(fmt_u32d_r(d, buf));
 }
 
-char * fmt_u16d(uint16_t d)
+char * fmt_u16d_r(uint16_t d, char buf[FMT_BUFSZ])
 {
-  uint8_t i;
-  init_buf();
-  i = sizeof(fmt_buf)-1;
-  do fmt_buf[--i] = '0' + (d%10); while( (d /= 10) );
-  return(fmt_buf + i);
+  return(fmt_u32d_r(d, buf));
 }
-char * fmt_i16d(int16_t d)
+
+char * fmt_i16d_r(int16_t d, char buf[FMT_BUFSZ])
 {
-  if( d < 0 ){
-    char * p;
-    p = fmt_u16d(0 - d);
-    *(--p) = '-';
-    return(p);
-  }else
-    return(fmt_u16d(d));
+  return(fmt_i32d_r(d, buf));
 }
 
 static inline char fmt_n(uint8_t nyb)
@@ -68,23 +84,22 @@ static inline char fmt_n(uint8_t nyb)
   nyb &= 0xf;
   return(nyb<10?'0'+nyb:'a'-10+nyb);
 }
-char * fmt_x(uint8_t d)
+char * fmt_x_r(uint8_t d, char buf[FMT_BUFSZ])
 {
   uint8_t i;
-  init_buf();
-  i = sizeof(fmt_buf) - 1;
-  fmt_buf[--i] = fmt_n(d);
+  i = FMT_BUFSZ - 1;
+  buf[i] = '\0';
+  buf[--i] = fmt_n(d);
   d >>= 4;
-  fmt_buf[--i] = fmt_n(d);
-  return(fmt_buf+i);
+  buf[--i] = fmt_n(d);
+  return(buf+i);
 }
-char * fmt_32x(uint32_t x)
+char * fmt_32x_r(uint32_t x, char buf[FMT_BUFSZ])
 {
   uint8_t i;
   char * bufp;
   static const char PROGMEM hexchars[] = "0123456789abcdef";
-  init_buf();
-  bufp = fmt_buf;
+  bufp = buf;
   *bufp++ = '0';
   *bufp++ = 'x';
   for(i = 0; i < 8; i++){
@@ -92,6 +107,12 @@ char * fmt_32x(uint32_t x)
     x <<= 4;
   }
   *bufp = '\0';
-  return(fmt_buf);
+  return(buf);
 }
 
+char * fmt_u32d(uint32_t d) { init_buf(); return(fmt_u32d_r(d, fmt_buf)); }
+char * fmt_i32d(int32_t d) { init_buf(); return(fmt_i32d_r(d, fmt_buf)); }
+char * fmt_u16d(uint16_t d) { init_buf(); return(fmt_u16d_r(d, fmt_buf)); }
+char * fmt_i16d(int16_t d) { init_buf(); return(fmt_i16d_r(d, fmt_buf)); }
+char * fmt_x(uint8_t d) { init_buf(); return(fmt_x_r(d, fmt_buf)); }
+char * fmt_32x(uint32_t x) { init_buf(); return(fmt_32x_r(x, fmt_buf)); }
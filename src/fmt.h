@@ -3,7 +3,21 @@
 /*
   Copyright 2020 Harold Tay LGPLv3
   Formatted output.
+
+  The _r versions write into the caller's buf[FMT_BUFSZ] and
+  return a pointer into it, so are reentrant.  The others share
+  one static buffer, good until the next call.
+  No division is used: the M0 has no divider, and the libgcc one
+  costs a call and a loop per digit.
  */
+#define FMT_BUFSZ 12
+extern char * fmt_u32d_r(uint32_t d, char buf[FMT_BUFSZ]);
+extern char * fmt_i32d_r(int32_t d, char buf[FMT_BUFSZ]);
+extern char * fmt_u16d_r(uint16_t d, char buf[FMT_BUFSZ]);
+extern char * fmt_i16d_r(int16_t d, char buf[FMT_BUFSZ]);
+extern char * fmt_x_r(uint8_t d, char buf[FMT_BUFSZ]);
+extern char * fmt_32x_r(uint32_t x, char buf[FMT_BUFSZ]);
+
 extern char * fmt_u32d(uint32_t d);
 extern char * fmt_i32d(int32_t d);
 extern char * fmt_u16d(uint16_t d);
@@ -0,0 +1,90 @@
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Host (Linux) stand-ins for the board specific functions used by
+  cfg.c and cfg_parse.c: rtc, tick and attn.  Wall time is the
+  host's time at start up plus the emulated time from sd-emu.c.
+ */
+#define _XOPEN_SOURCE 700
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "rtc.h"
+#include "tick.h"
+#include "attn.h"
+#include "fmt.h"
+#include "sd-emu.h"
+
+static time_t host_epoch;
+
+static uint8_t tobcd(uint8_t d) { return(((d/10)<<4) | d%10); }
+
+int8_t rtc_init(struct rtc * rp)
+{
+  if (!host_epoch) host_epoch = time(0);
+  return(0);
+}
+
+int8_t rtc_now(struct rtc * rp)
+{
+  struct tm tm;
+  time_t t;
+
+  if (!host_epoch) host_epoch = time(0);
+  t = host_epoch + sd_emu_stats.now_ns/1000000000ULL;
+  localtime_r(&t, &tm);
+  rp->seconds = tobcd(tm.tm_sec);
+  rp->minutes = tobcd(tm.tm_min);
+  rp->hours = tobcd(tm.tm_hour);
+  rp->day_of_month = tobcd(tm.tm_mday);
+  rp->month = tobcd(tm.tm_mon + 1);
+  rp->year = tobcd(tm.tm_year % 100);
+  rp->day_of_week = tm.tm_wday + 1;
+  return(0);
+}
+
+int8_t rtc_alarm(struct rtc * rp) { return(0); }
+int8_t rtc_rearm(void) { return(0); }
+void rtc_user(struct rtc * rp) { (void)rtc_now(rp); }
+
+char * rtc_print(struct rtc * rp)
+{
+  static char buf[24];
+  static char * wk[] = {
+    "",  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  strcpy(buf, "20");
+  strcat(buf, fmt_x(rp->year & 0x3f));
+  strcat(buf, "-");
+  strcat(buf, fmt_x(rp->month & 0x1f));
+  strcat(buf, "-");
+  strcat(buf, fmt_x(rp->day_of_month & 0x3f));
+  strcat(buf, "T");
+  strcat(buf, fmt_x(rp->hours & 0x3f));
+  strcat(buf, ":");
+  strcat(buf, fmt_x(rp->minutes & 0x7f));
+  strcat(buf, ":");
+  strcat(buf, fmt_x(rp->seconds & 0x7f));
+  strcat(buf, " ");
+  if (rp->day_of_week <= 7)
+    strcat(buf, wk[rp->day_of_week]);
+  return(buf);
+}
+
+static uint64_t old_value;
+void tick_init(void) { old_value = (uint64_t)-1; }
+bool tick_need_stamp(void)
+{
+  uint64_t new_value;
+  new_value = sd_emu_stats.now_ns/1000000000ULL;
+  if (new_value == old_value) return(false);
+  old_value = new_value;
+  return(true);
+}
+
+uint16_t tick_now(void)
+{
+  return(sd_emu_stats.now_ns/1365333ULL);
+}
+
+void attn_init(void) { }
+void attn_on(void) { }
+void attn_off(void) { }
@@ -1,20 +1,52 @@
 /*
   Copyright 2020 Harold Tay LGPLv3
   Assumes PCM1808 interfaced to stm32f051c8t6.
-  Data are copied by DMA to a circular memory buffer.
+  Data are copied by DMA to a circular memory buffer, read a
+  sector at a time with pcm1808_ring.c.
  */
 
 #include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/spi.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/cortex.h>
 #include "pcm1808.h"
 #ifndef MHZ
 #define MHZ 48
 #endif
 #include "delay.h"
 
-uint16_t pcm1808_buf[PCM1808_BUFSZ];
+/* Shared by DMA1 channels 2 and 3, but only 2 is used. */
+void dma1_channel2_3_isr(void)
+{
+  if (dma_get_interrupt_flag(I2S_DMA, I2S_CHANNEL, DMA_HTIF)) {
+    dma_clear_interrupt_flags(I2S_DMA, I2S_CHANNEL, DMA_HTIF);
+    pcm1808_halves++;
+  }
+  if (dma_get_interrupt_flag(I2S_DMA, I2S_CHANNEL, DMA_TCIF)) {
+    dma_clear_interrupt_flags(I2S_DMA, I2S_CHANNEL, DMA_TCIF);
+    pcm1808_halves++;
+  }
+}
+
+uint16_t pcm1808_head(void) { return(PCM1808_HEAD); }
+
+/*
+  Interrupts are masked from the test to the WFI, so a half that
+  completes in between still wakes us (pending interrupts end a
+  WFI even when masked), and is serviced once they are unmasked.
+  Otherwise we could sleep through it until the next half, by
+  when the DMA is refilling the one we missed.
+ */
+void pcm1808_wait(void)
+{
+  cm_disable_interrupts();
+  if (pcm1808_tail >= pcm1808_halves * PCM1808_HALF_SECTORS)
+    __asm__("wfi");
+  cm_enable_interrupts();
+}
 
 int8_t pcm1808_start(void)
 {
@@ -43,6 +75,11 @@ int8_t pcm1808_start(void)
   dma_set_peripheral_size(WHICH, DMA_CCR_PSIZE_16BIT);
   dma_set_memory_size(WHICH, DMA_CCR_MSIZE_16BIT);
   dma_set_priority(WHICH, DMA_CCR_PL_VERY_HIGH);
+  dma_enable_half_transfer_interrupt(WHICH);
+  dma_enable_transfer_complete_interrupt(WHICH);
+  pcm1808_halves = pcm1808_tail = 0;
+  SCB_SCR &= ~SCB_SCR_SLEEPDEEP;      /* pcm1808_wait() must not STOP */
+  nvic_enable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
   dma_enable_channel(WHICH);
 
   rcc_periph_clock_enable(I2S_RCC);
@@ -84,5 +121,6 @@ void pcm1808_stop(void)
   int i;
   SPI_I2SCFGR(I2S_SPI) &= ~SPI_I2SCFGR_I2SE;
   for (i = 300; i > 0 && SPI_SR(I2S_SPI) & SPI_SR_BSY; i--);
+  nvic_disable_irq(NVIC_DMA1_CHANNEL2_3_IRQ);
   dma_channel_reset(WHICH);
 }
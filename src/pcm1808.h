@@ -1,6 +1,10 @@
 #ifndef PCM1808_H
 #define PCM1808_H
+#include <stdbool.h>
+#include <stdint.h>
+#ifndef HOST
 #include <libopencm3/stm32/dma.h>
+#endif
 /*
   Copyright 2020 Harold Tay LGPLv3
   Data are added by DMA to pcm1808_buf[PCM1808_HEAD] (circular
@@ -13,7 +17,55 @@
  */
 #define PCM1808_BUFSZ 2560
 extern uint16_t pcm1808_buf[PCM1808_BUFSZ];
+#ifndef HOST
 #define PCM1808_HEAD (PCM1808_BUFSZ-DMA_CNDTR(I2S_DMA, I2S_CHANNEL))
+#endif
+extern uint16_t pcm1808_head(void);   /* PCM1808_HEAD, or emulated */
+
+/*
+  Sector granular access to the same buffer.  pcm1808_buf is
+  PCM1808_NR_SECTORS slots of 512 bytes, in two halves.  The DMA
+  half transfer and transfer complete interrupts count halves
+  filled; every sector of a filled half is available, oldest
+  first, from pcm1808_next() until pcm1808_release().
+
+  A sector in half h is intact until the DMA starts refilling
+  half h, i.e. until pcm1808_halves reaches (its half count)+2.
+  pcm1808_lapped() checks this before a sector is written out,
+  and pcm1808_release() again after, so an overrun cannot go
+  unseen.  These are in pcm1808_ring.c, which also builds for the
+  host; pcm1808_head() and pcm1808_wait() are all the host test
+  has to emulate.
+ */
+#define PCM1808_SECTOR_WORDS 256
+#define PCM1808_NR_SECTORS (PCM1808_BUFSZ/PCM1808_SECTOR_WORDS)
+#define PCM1808_HALF_SECTORS (PCM1808_NR_SECTORS/2)
+#if PCM1808_NR_SECTORS*PCM1808_SECTOR_WORDS != PCM1808_BUFSZ \
+  || PCM1808_HALF_SECTORS*2 != PCM1808_NR_SECTORS
+#error PCM1808_BUFSZ must be an even number of sectors
+#endif
+extern volatile uint32_t pcm1808_halves; /* filled by DMA so far */
+extern uint32_t pcm1808_tail;         /* sectors released so far */
+/* Oldest unreleased sector, or 0 if none is ready */
+extern uint16_t * pcm1808_next(void);
+/*
+  The DMA has come round to the sector from pcm1808_next(), which
+  now holds newer samples, in part or whole.  Don't write it,
+  pcm1808_release() it.
+ */
+extern bool pcm1808_lapped(void);
+/*
+  Done with the sector from pcm1808_next().  Returns the number of
+  sectors overwritten by the DMA before they were released (0
+  normally), and skips to the oldest intact one.
+ */
+extern uint16_t pcm1808_release(void);
+/*
+  Sleep (WFI, not STOP) until pcm1808_next() has a sector, i.e.
+  until the next half transfer or transfer complete interrupt.
+  Returns at once if one is ready already.
+ */
+extern void pcm1808_wait(void);
 
 /*
   Errors that might be returned
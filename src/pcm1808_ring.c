@@ -0,0 +1,44 @@
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Sector granular access to pcm1808_buf, declared in pcm1808.h.
+  No hardware here, so the host test (test-emu.c) uses it too,
+  filling the buffer from an emulated DMA.
+ */
+#include <stdint.h>
+#include "pcm1808.h"
+
+uint16_t pcm1808_buf[PCM1808_BUFSZ];
+volatile uint32_t pcm1808_halves;
+uint32_t pcm1808_tail;
+
+uint16_t * pcm1808_next(void)
+{
+  if (pcm1808_tail >= pcm1808_halves * PCM1808_HALF_SECTORS)
+    return(0);
+  return(pcm1808_buf +
+    (pcm1808_tail % PCM1808_NR_SECTORS) * PCM1808_SECTOR_WORDS);
+}
+
+bool pcm1808_lapped(void)
+{
+  return(pcm1808_halves >=
+    pcm1808_tail / PCM1808_HALF_SECTORS + 2);
+}
+
+uint16_t pcm1808_release(void)
+{
+  uint32_t half, halves, oldest;
+
+  halves = pcm1808_halves;
+  half = pcm1808_tail / PCM1808_HALF_SECTORS;
+  pcm1808_tail++;
+  if (halves < half + 2)
+    return(0);
+  /* DMA is in (or past) our half again, skip to the oldest intact */
+  oldest = (halves - 1) * PCM1808_HALF_SECTORS;
+  if (oldest < pcm1808_tail)
+    oldest = pcm1808_tail;
+  half = oldest - pcm1808_tail + 1;   /* including the one released */
+  pcm1808_tail = oldest;
+  return(half);
+}
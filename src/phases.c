@@ -0,0 +1,98 @@
+/*
+  Copyright 2020 Harold Tay GPLv3
+  Host tool: summarise the wake up phases written by trace_log()
+  (trace.h) to the log file, to see where the time from wake up
+  to the first sample goes.
+
+  Usage: phases [SITEA-0.LOG ...]
+  Reads stdin if no files are given, so the serial diagnostics or
+  test-emu output will do as well.  Every " ph_name=ms" token is
+  counted, and for each phase prints the count, mean, min and max
+  ms, and its share of the summed ph_total.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NR_PHASES 32
+
+struct phase {
+  char name[24];
+  unsigned long count, sum, min, max;
+};
+
+static struct phase phases[NR_PHASES];
+static int nr_phases;
+
+static struct phase * lookup(char * name)
+{
+  int i;
+  for (i = 0; i < nr_phases; i++)
+    if (0 == strcmp(phases[i].name, name)) return(phases + i);
+  if (nr_phases >= NR_PHASES) return(0);
+  strncpy(phases[i].name, name, sizeof(phases[i].name) - 1);
+  phases[i].min = (unsigned long)-1;
+  return(phases + nr_phases++);
+}
+
+static void scan(FILE * fp)
+{
+  char buf[256], * cp, * eq, * end;
+  unsigned long ms;
+  struct phase * p;
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    for (cp = buf; (cp = strstr(cp, " ph_")); ) {
+      cp++;
+      eq = strchr(cp, '=');
+      if (!eq || eq - cp >= (int)sizeof(p->name)) continue;
+      *eq = '\0';
+      ms = strtoul(eq + 1, &end, 10);
+      if (end == eq + 1) { cp = eq + 1; continue; }
+      p = lookup(cp);
+      cp = end;
+      if (!p) continue;
+      p->count++;
+      p->sum += ms;
+      if (ms < p->min) p->min = ms;
+      if (ms > p->max) p->max = ms;
+    }
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  struct phase * p, * total;
+  FILE * fp;
+  int i;
+
+  if (argc < 2)
+    scan(stdin);
+  for (i = 1; i < argc; i++) {
+    fp = fopen(argv[i], "r");
+    if (!fp) {
+      perror(argv[i]);
+      return(1);
+    }
+    scan(fp);
+    fclose(fp);
+  }
+  if (!nr_phases) {
+    fprintf(stderr, "No ph_ phases found\n");
+    return(1);
+  }
+
+  total = lookup("ph_total");
+  printf("%-16s %6s %9s %7s %7s %6s\n",
+    "phase", "count", "mean_ms", "min", "max", "share");
+  for (i = 0; i < nr_phases; i++) {
+    p = phases + i;
+    if (!p->count) continue;
+    printf("%-16s %6lu %9.1f %7lu %7lu", p->name, p->count,
+      (double)p->sum/p->count, p->min, p->max);
+    if (total && total->sum)
+      printf(" %5.1f%%", 100.0*p->sum/total->sum);
+    printf("\n");
+  }
+  return(0);
+}
@@ -0,0 +1,21 @@
+#ifndef RAMFUNC_H
+#define RAMFUNC_H
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Tag a function RAMFUNC to have it run from SRAM, where there
+  are no flash wait states.  It goes in .ramtext, which
+  ramtext.ld puts in .data (the Makefile adds it to linkscript.ld),
+  so the startup code copies it from flash with the initialised
+  data.  RAM is short: keep to small
+  functions on the per byte or per sample path, and check the
+  cost with "make kinabalu.ram".  -DNO_RAMFUNC puts them back in
+  flash.
+ */
+
+#if defined(HOST) || defined(NO_RAMFUNC)
+#define RAMFUNC /* nothing */
+#else
+#define RAMFUNC __attribute__((section(".ramtext"), noinline))
+#endif
+
+#endif /* RAMFUNC_H */
@@ -0,0 +1,163 @@
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  See rec.h.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rec.h"
+#include "pcm1808.h"
+#include "wav.h"
+#include "sd2.h"
+#include "tick.h"
+#include "ramfunc.h"
+
+/*
+  Left channel only (even indices) of one sector of pcm1808_buf,
+  half a sector of mono.  Returns WAV_BUSY if the previous half
+  could not be written yet, the sector has not been taken then.
+ */
+static uint16_t tmpbuf[PCM1808_SECTOR_WORDS/2];
+static bool tmp_pending;              /* tmpbuf[] not yet written */
+static bool mark_pending;             /* wav_mark() after tmpbuf[] */
+RAMFUNC static int8_t add_mono(uint16_t * buf)
+{
+  uint16_t i, n;
+  int8_t er;
+
+  if (tmp_pending) {
+    n = sizeof(tmpbuf)/2;
+    er = wav_add_nb(tmpbuf, &n);
+    if (er) return(er);               /* busy, complete or error */
+    tmp_pending = false;
+  }
+  if (mark_pending) {
+    wav_mark();
+    mark_pending = false;
+  }
+  for (i = 0; i < sizeof(tmpbuf)/2; i++)
+    tmpbuf[i] = buf[2*i];
+  n = sizeof(tmpbuf)/2;
+  er = wav_add_nb(tmpbuf, &n);
+  if (WAV_BUSY == er) {               /* sector taken, write it later */
+    tmp_pending = true;
+    er = 0;
+  }
+  return(er);
+}
+/* Where the gap is: after what is written, including tmpbuf[] */
+static void mark(void)
+{
+  if (tmp_pending)
+    mark_pending = true;
+  else
+    wav_mark();
+}
+
+/*
+  Words written by the DMA so far, used as a clock to time the
+  card.  May be out by half the buffer around a half transfer.
+ */
+static uint32_t dma_words(void)
+{
+  return(pcm1808_halves*(PCM1808_BUFSZ/2) +
+    pcm1808_head()%(PCM1808_BUFSZ/2));
+}
+
+/*
+  How long the card kept each sector waiting, in bins of under
+  1ms, 1-2ms, 2-4ms and so on to 64ms and over.  Most should be
+  in the first; a card that is wearing out moves to the right.
+ */
+char * rec_busy_bin_names[REC_NR_BUSY_BINS] = {
+  "busy_ms_0", "busy_ms_1", "busy_ms_2", "busy_ms_4",
+  "busy_ms_8", "busy_ms_16", "busy_ms_32", "busy_ms_64" };
+static void busy_bin(struct rec_stats * sp, uint32_t words)
+{
+  uint32_t ms;
+  uint8_t i;
+
+  ms = (words*500UL)/WAV_SPS;
+  for (i = 0; ms && i < REC_NR_BUSY_BINS - 1; i++)
+    ms >>= 1;
+  sp->busy_bins[i]++;
+}
+
+/*
+  Whole sectors as the DMA fills them.  Never wait for the card
+  here: if it is busy, come round again and keep track of how
+  close the DMA is to lapping us.  With nothing to do, sleep
+  until the DMA interrupt for the next half; that is most of the
+  time, as the card is much faster than the ADC.  Anything to be
+  done per half (filtering, level) would go after the wait.
+  A sector the DMA has lapped while the card was busy is not
+  written (newer samples would be mixed in), but skipped with
+  the rest that were lost: counted, and marked as a cue point,
+  once per gap however often the DMA laps us before the card is
+  ready.  Not once it is going out by sd_xmit() (stereo); if it
+  is lapped then, pcm1808_release() still counts it.
+ */
+int8_t rec_sectors(bool mono, struct rec_stats * sp)
+{
+  int8_t er;
+  uint16_t lwm, count, headroom, n, t;
+  uint32_t busy_since, busy;
+  bool is_busy, in_gap;
+  uint16_t * buf;
+
+  memset(sp, 0, sizeof(*sp));
+  sp->min_headroom = PCM1808_BUFSZ;
+  tmp_pending = mark_pending = false;
+  busy_since = 0;
+  is_busy = in_gap = false;
+
+  for ( ; ; ) {
+    lwm = (pcm1808_tail % PCM1808_NR_SECTORS) * PCM1808_SECTOR_WORDS;
+    headroom = PCM1808_BUFSZ -
+      (pcm1808_head() - lwm + PCM1808_BUFSZ)%PCM1808_BUFSZ;
+    if (headroom < sp->min_headroom)
+      sp->min_headroom = headroom;
+    buf = pcm1808_next();
+    if (!buf) {
+      t = tick_now();
+      pcm1808_wait();
+      sp->asleep += (uint16_t)(tick_now() - t);
+      continue;
+    }
+    if (pcm1808_lapped() && (mono || !sd_bwrites_sending())) {
+      sp->dropped += pcm1808_release();
+      if (!in_gap) {
+        sp->overruns++;
+        mark();
+      }
+      in_gap = true;
+      continue;
+    }
+    if (mono) {
+      er = add_mono(buf);
+    } else {
+      count = PCM1808_SECTOR_WORDS;
+      er = wav_add_nb(buf, &count);
+    }
+    if (WAV_BUSY == er) {
+      if (!is_busy) busy_since = dma_words();
+      is_busy = true;
+      continue;
+    }
+    busy = 0;
+    if (is_busy) {
+      busy = dma_words() - busy_since;
+      if ((int32_t)busy > (int32_t)sp->max_busy) sp->max_busy = busy;
+      is_busy = false;
+    }
+    busy_bin(sp, busy);
+    if (er) return(er);
+    n = pcm1808_release();
+    in_gap = (n != 0);
+    if (n) {                          /* DMA lapped us, n sectors lost */
+      sp->overruns++;
+      sp->dropped += n;
+      mark();
+    }
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef REC_H
+#define REC_H
+#include <stdint.h>
+#include <stdbool.h>
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  The sector loop of a recording: from pcm1808_next() to
+  wav_add_nb() until the file is complete.  Call after
+  wav_record() and pcm1808_start().  Returns as wav_add_nb() does
+  when it has finished (1) or failed, with what happened on the
+  way in *sp.  Built for the host too, for test-emu.c.
+ */
+#define REC_NR_BUSY_BINS 8
+struct rec_stats {
+  uint16_t min_headroom;              /* words, before the DMA laps */
+  uint16_t dropped;                   /* sectors lost to overruns */
+  uint16_t overruns;                  /* gaps, each a wav_mark() */
+  uint32_t max_busy;                  /* words, longest card wait */
+  uint32_t asleep;                    /* ticks in pcm1808_wait() */
+  uint16_t busy_bins[REC_NR_BUSY_BINS];
+};
+extern char * rec_busy_bin_names[REC_NR_BUSY_BINS];
+extern int8_t rec_sectors(bool mono, struct rec_stats * sp);
+
+#endif /* REC_H */
@@ -5,8 +5,11 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+#include <stdbool.h>
 #define MHZ 48
 #include "delay.h"
+#include "ramfunc.h"
 
 #undef DBG
 #ifdef DBG
@@ -24,6 +27,14 @@ static int sd_spi_prescaler;
 #define SD_SPI   SPI2
 #define SD_RCC   RCC_SPI2
 
+/* SPI2_TX is fixed to DMA1 channel 5 on the stm32f051 */
+#define SD_DMA         DMA1
+#define SD_DMA_RCC     RCC_DMA1
+#define SD_TX_CHANNEL  DMA_CHANNEL5
+#define SD_TX          SD_DMA, SD_TX_CHANNEL
+/* Fewer bytes than this aren't worth setting up the DMA for */
+#define SD_DMA_MIN     16
+
 #define CS_RCC   RCC_GPIOB
 #define CS_PORT  GPIOB
 #define CS_BIT   GPIO12
@@ -67,7 +78,9 @@ int8_t sd_spi_init(void)              /* used by sd2.c */
 
   spi_set_unidirectional_mode(SD_SPI);
   spi_disable_crc(SD_SPI);
+  SPI_CRCPR(SD_SPI) = 0x1021;         /* CCITT, for sd_crc_start() */
   spi_set_data_size(SD_SPI, SPI_CR2_DS_8BIT);
+  spi_fifo_reception_threshold_8bit(SD_SPI); /* RXNE per byte */
   spi_set_full_duplex_mode(SD_SPI);                          /* XXX? */
   spi_enable_software_slave_management(SD_SPI);
   spi_set_nss_high(SD_SPI);             /* Important! or SPI -> slave */
@@ -80,6 +93,8 @@ int8_t sd_spi_init(void)              /* used by sd2.c */
   spi_enable_ss_output(SD_SPI);
   spi_enable(SD_SPI);
 
+  rcc_periph_clock_enable(SD_DMA_RCC);
+
   dbg(tx_puts("sd_spi_init ok\r\n"));
   return(0);
 }
@@ -93,10 +108,21 @@ void sd_spi_reset(void)
   gpio_mode_setup(SCK_PORT,  GPIO_MODE_INPUT, GPIO_PUPD_NONE, SCK_BIT);
 }
 
-uint8_t sd_xfer(uint8_t x)
+/*
+  The byte returned must be the one clocked in for x, not one left
+  in the rx FIFO from before, or a data token seen here would be a
+  byte late, and sd_recv() would then drop the first data byte
+  with the leftovers.  So empty the FIFO first and wait for RXNE,
+  which needs the 8 bit FIFO threshold (else RXNE waits for a
+  second byte: that was the hang).  The wait is bounded anyway.
+ */
+RAMFUNC uint8_t sd_xfer(uint8_t x)
 {
   uint16_t i, j;
 
+  while (SPI_SR(SD_SPI) & SPI_SR_RXNE)
+    (void)SPI_DR8(SD_SPI);
+
   /* spi_send8() */
   j = ((sd_spi_prescaler==SD_SPI_PRESCALER_FAST)?1:32);
   for ( ; j > 0; j--) {
@@ -120,13 +146,142 @@ send:
   SPI_DR8(SD_SPI) = x;
 
   /* spi_read8() */
-  /*
-    XXX Can hang here, even after hard reset (but ok if
-    reflashed).
-  while (!(SPI_SR(SD_SPI) & SPI_SR_RXNE)) ;
-   */
+  for (i = 30000; i > 0; i--)
+    if (SPI_SR(SD_SPI) & SPI_SR_RXNE) break;
+#ifdef DBG
+  if (!i) tx_puts("sd_xfer timed out waiting for SPI_SR_RXNE\r\n");
+#endif
   return(SPI_DR8(SD_SPI));
 }
+
+/*
+  Memory to SPI2 by DMA, at lower priority than the I2S channel.
+  sd_xmit() only starts it; the CPU is free until sd_xmit_done(),
+  it no longer has to feed SPI_DR one byte at a time.
+ */
+static bool xmit_dma;                 /* started, not yet done */
+void sd_xmit(uint8_t * buf, uint16_t len)
+{
+  if (len < SD_DMA_MIN) {
+    for ( ; len > 0; len--)
+      (void)sd_xfer(*buf++);
+    return;
+  }
+
+  dma_channel_reset(SD_TX);
+  dma_set_peripheral_address(SD_TX, (uint32_t)&(SPI_DR(SD_SPI)));
+  dma_set_memory_address(SD_TX, (uint32_t)buf);
+  dma_set_number_of_data(SD_TX, len);
+  dma_set_read_from_memory(SD_TX);
+  dma_enable_memory_increment_mode(SD_TX);
+  dma_set_peripheral_size(SD_TX, DMA_CCR_PSIZE_8BIT);
+  dma_set_memory_size(SD_TX, DMA_CCR_MSIZE_8BIT);
+  dma_set_priority(SD_TX, DMA_CCR_PL_HIGH);
+  dma_enable_channel(SD_TX);
+  spi_enable_tx_dma(SD_SPI);
+  xmit_dma = true;
+}
+
+/*
+  Done once the DMA has handed over the last byte and the SPI
+  has clocked it out.  Received bytes are thrown away, which
+  leaves the rx FIFO overrun, so clear that after.
+ */
+bool sd_xmit_done(void)
+{
+  if (!xmit_dma) return(true);
+  if (!dma_get_interrupt_flag(SD_TX, DMA_TCIF)) return(false);
+  if (!(SPI_SR(SD_SPI) & SPI_SR_TXE)) return(false);
+  if (SPI_SR(SD_SPI) & SPI_SR_BSY) return(false);
+
+  spi_disable_tx_dma(SD_SPI);
+  dma_disable_channel(SD_TX);
+  dma_clear_interrupt_flags(SD_TX, DMA_TCIF);
+  xmit_dma = false;
+
+  while (SPI_SR(SD_SPI) & SPI_SR_RXNE)
+    (void)SPI_DR8(SD_SPI);
+  (void)SPI_SR(SD_SPI);               /* clears OVR */
+  return(true);
+}
+
+/*
+  The CRC unit is only reset by turning it off and on, which
+  must be done with the SPI idle and disabled.  CRCL makes it
+  16 bits over 8 bit frames.  It is never asked to send the CRC
+  itself (CRCNEXT), sd2.c does that.
+ */
+void sd_crc_start(void)
+{
+  while (SPI_SR(SD_SPI) & SPI_SR_BSY) ;
+  SPI_CR1(SD_SPI) &= ~(SPI_CR1_SPE | SPI_CR1_CRCEN);
+  SPI_CR1(SD_SPI) |= SPI_CR1_CRCL | SPI_CR1_CRCEN;
+  SPI_CR1(SD_SPI) |= SPI_CR1_SPE;
+}
+
+uint16_t sd_crc_tx(void)
+{
+  while (SPI_SR(SD_SPI) & SPI_SR_BSY) ;
+  return(SPI_TXCRCR(SD_SPI));
+}
+
+uint16_t sd_crc_rx(void)
+{
+  while (SPI_SR(SD_SPI) & SPI_SR_BSY) ;
+  return(SPI_RXCRCR(SD_SPI));
+}
+
+/*
+  Data size can only be changed with the SPI disabled, which must
+  wait for it to be idle.  Anything left in the rx FIFO is
+  dropped; sd_xfer() has taken the bytes it clocked, so that is
+  nothing that was asked for.
+ */
+static void frame_size(uint32_t ds, bool bits8)
+{
+  while (SPI_SR(SD_SPI) & SPI_SR_BSY) ;
+  SPI_CR1(SD_SPI) &= ~SPI_CR1_SPE;
+  while (SPI_SR(SD_SPI) & SPI_SR_RXNE)
+    (void)SPI_DR8(SD_SPI);
+  spi_set_data_size(SD_SPI, ds);
+  if (bits8)
+    spi_fifo_reception_threshold_8bit(SD_SPI);
+  else
+    spi_fifo_reception_threshold_16bit(SD_SPI);
+  SPI_CR1(SD_SPI) |= SPI_CR1_SPE;
+}
+
+/*
+  With 16 bit frames there is one wait on the SPI per 2 bytes.
+  The next frame is queued before the last is read, so the SPI
+  does not idle between frames.  First byte on the wire is the
+  high byte of a frame.
+ */
+#define SD_DR16 (*(volatile uint16_t *)&SPI_DR(SD_SPI))
+RAMFUNC void sd_recv(uint8_t * buf, uint16_t len)
+{
+  uint16_t n, w;
+
+  if (len < 4) {
+    for ( ; len > 0; len--)
+      *buf++ = sd_xfer(0xff);
+    return;
+  }
+  frame_size(SPI_CR2_DS_16BIT, false);
+  n = len/2;
+  SD_DR16 = 0xffff;
+  for ( ; n > 0; n--) {
+    if (n > 1) SD_DR16 = 0xffff;
+    while (!(SPI_SR(SD_SPI) & SPI_SR_RXNE)) ;
+    w = SD_DR16;
+    *buf++ = w >> 8;
+    *buf++ = w & 0xff;
+  }
+  frame_size(SPI_CR2_DS_8BIT, true);
+  if (len & 1)
+    *buf = sd_xfer(0xff);
+}
+
 void sd_cs_hi(void) { CS_HIGH; }
 void sd_cs_lo(void) { CS_LOW; }
 void sd_delay(uint8_t i)
@@ -0,0 +1,763 @@
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  SD card emulator for host builds.  Implements the functions
+  declared in sd2.h as an SPI mode SDHC state machine.  Only what
+  sd2.c actually uses is emulated.
+ */
+#define _XOPEN_SOURCE 700
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sd2.h"
+#include "sd-emu.h"
+
+#define UNIT_BLOCKS 32                /* smallest AU, 16kB */
+
+struct sd_emu_model sd_emu_model = {
+  .slow_hz = 48000000/128,            /* as sd-arch.c */
+  .fast_hz = 48000000/4,
+  .cmd_bytes = 1,
+  .read_us = 200,
+  .mread_us = 20,
+  .write_us = 250,
+  .stop_us = 1000,
+  .stall_every = 0,
+  .stall_us = 0,
+  .stall_ppm = 0,
+  .seed = 1,
+  .au_code = 9,
+  .au_copy_us = 0,
+  .erase_us = 2000,
+  .au_erase_us = 0,
+  .crc_err_ppm = 0,
+  .poll_cycles = 0,
+  .frame16 = 1,
+  .rx_lag = 0,
+  .init_polls = 20,
+};
+
+struct sd_emu_stats sd_emu_stats;
+
+#define R1_IDLE    0x01
+#define R1_ILLEGAL 0x04
+#define R1_CRC     0x08
+#define R1_PARAM   0x40
+
+#define DATA_ACCEPTED 0x05
+
+enum state {
+  ST_IDLE,                            /* waiting for a command */
+  ST_CMD,                             /* collecting command bytes */
+  ST_WR_TOKEN,                        /* CMD24, waiting for 0xfe */
+  ST_WR_DATA,                         /* CMD24, receiving block */
+  ST_MW_TOKEN,                        /* CMD25, waiting for 0xfc/0xfd */
+  ST_MW_DATA,                         /* CMD25, receiving block */
+};
+
+static struct {
+  int fd;
+  uint32_t nr_blocks;
+  enum state state;
+  uint8_t cs;                         /* CS asserted (low) */
+  uint8_t fast;
+  uint8_t initialised;                /* ACMD41 completed */
+  uint8_t app;                        /* last command was CMD55 */
+  uint8_t polls;                      /* ACMD41 calls so far */
+  uint8_t cmd[6];
+  uint8_t cmd_len;
+  uint8_t out[520];                   /* bytes to shift out */
+  uint16_t out_len, out_pos;
+  uint64_t out_ns;                    /* not before this time */
+  uint32_t addr;                      /* read or write block */
+  uint8_t pending_read;
+  uint8_t multi_read;                 /* CMD18 until CMD12 */
+  uint8_t status_read;                /* ACMD13 */
+  uint8_t au_partial;                 /* CMD25 began inside an AU */
+  uint8_t mw_first;                   /* next block is CMD25's first */
+  uint32_t erase_start, erase_end;    /* CMD32, CMD33 */
+  uint8_t * erased;                   /* per 16kB unit, by CMD38 */
+  uint8_t crc_on;                     /* CMD59 */
+  uint16_t crc_tx, crc_rx;            /* host SPI CRC unit */
+  uint64_t read_ns;                   /* data token ready */
+  uint8_t data[512+2];                /* incoming block with CRC */
+  uint16_t data_len;
+  uint64_t busy_ns;                   /* DO held low until */
+  uint32_t nr_written;                /* for stall_every */
+  uint32_t rand;
+} card = { .fd = -1 };
+
+static uint8_t crc7(uint8_t * p, uint8_t len)
+{
+  uint8_t crc, i;
+  crc = 0;
+  for ( ; len > 0; len--) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ (0x09 << 1) : crc << 1;
+  }
+  return(crc | 1);
+}
+
+static uint16_t crc16_add(uint16_t crc, uint8_t x)
+{
+  uint8_t i;
+  crc ^= (uint16_t)x << 8;
+  for (i = 0; i < 8; i++)
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  return(crc);
+}
+
+static uint16_t crc16(uint8_t * p, uint16_t len)
+{
+  uint16_t crc;
+  crc = 0;
+  for ( ; len > 0; len--)
+    crc = crc16_add(crc, *p++);
+  return(crc);
+}
+
+static uint64_t us_ns(uint32_t us) { return((uint64_t)us * 1000); }
+
+static uint64_t byte_ns(void)
+{
+  uint32_t hz;
+  hz = card.fast ? sd_emu_model.fast_hz : sd_emu_model.slow_hz;
+  return(8000000000ULL / hz);
+}
+
+static void respond(uint8_t * p, uint16_t len)
+{
+  memcpy(card.out, p, len);
+  card.out_len = len;
+  card.out_pos = 0;
+  card.out_ns = sd_emu_stats.now_ns +
+    (sd_emu_model.cmd_bytes - 1) * byte_ns();
+}
+
+static void respond1(uint8_t r1)
+{
+  respond(&r1, 1);
+}
+
+static int blk_read(uint32_t addr, uint8_t * buf)
+{
+  ssize_t n;
+  n = pread(card.fd, buf, 512, (off_t)addr * 512);
+  if (n < 0) return(-1);
+  if (n < 512) memset(buf + n, 0, 512 - n);
+  return(0);
+}
+
+static int blk_write(uint32_t addr, uint8_t * buf)
+{
+  return(pwrite(card.fd, buf, 512, (off_t)addr * 512) == 512 ? 0 : -1);
+}
+
+static uint32_t rnd(void)
+{
+  card.rand = card.rand * 1103515245 + 12345;
+  return(card.rand >> 8);
+}
+
+/* Is this block to be corrupted on the bus? */
+static int crc_err(void)
+{
+  if (!sd_emu_model.crc_err_ppm) return(0);
+  if ((rnd() % 1000000) >= sd_emu_model.crc_err_ppm) return(0);
+  sd_emu_stats.crc_errs++;
+  return(1);
+}
+
+/* How long the card stays busy after accepting a data block */
+static uint64_t write_busy_ns(void)
+{
+  uint64_t ns;
+  int stall;
+
+  ns = us_ns(sd_emu_model.write_us);
+  card.nr_written++;
+  stall = 0;
+  if (sd_emu_model.stall_every &&
+    !(card.nr_written % sd_emu_model.stall_every))
+    stall = 1;
+  if (sd_emu_model.stall_ppm &&
+    (rnd() % 1000000) < sd_emu_model.stall_ppm)
+    stall = 1;
+  if (stall) {
+    ns += us_ns(sd_emu_model.stall_us);
+    sd_emu_stats.stalls++;
+  }
+  return(ns);
+}
+
+/* Decoded as by sd_au_sectors() */
+static uint32_t au_blocks(void)
+{
+  if (sd_emu_model.au_code > 15) return(0);
+  return(sd_au_code_sectors(sd_emu_model.au_code));
+}
+
+static void block_received(void)
+{
+  uint64_t ns;
+  uint8_t res;
+  uint32_t au;
+
+  res = DATA_ACCEPTED;
+  if (crc_err()) card.data[100] ^= 0x10;
+  if (card.crc_on &&
+    crc16(card.data, 512) != ((card.data[512] << 8) | card.data[513])) {
+    respond1(0x0b);                   /* CRC error, not written */
+    return;
+  }
+  if (card.addr >= card.nr_blocks || blk_write(card.addr, card.data))
+    res = 0x0d;                       /* write error */
+  else
+    sd_emu_stats.blocks_written++;
+  respond1(res);
+  ns = write_busy_ns();
+  /*
+    Multi-block write started part way into an AU: the card has to
+    copy the rest of that AU when the write moves on to the next.
+   */
+  au = au_blocks();
+  if (ST_MW_TOKEN == card.state && card.au_partial && au
+    && !(card.addr % au)) {
+    card.au_partial = 0;
+    ns += us_ns(sd_emu_model.au_copy_us);
+  }
+  /*
+    Multi-block write going into an AU that has not been erased
+    by CMD38: the card erases it first.
+   */
+  if (ST_MW_TOKEN == card.state && au && sd_emu_model.au_erase_us
+    && (card.mw_first || !(card.addr % au))
+    && card.addr < card.nr_blocks
+    && !card.erased[card.addr/UNIT_BLOCKS])
+    ns += us_ns(sd_emu_model.au_erase_us);
+  card.mw_first = 0;
+  if (card.addr < card.nr_blocks)
+    card.erased[card.addr/UNIT_BLOCKS] = 0;
+  card.addr++;
+  sd_emu_stats.busy_ns += ns;
+  if (ns > sd_emu_stats.busy_max_ns)
+    sd_emu_stats.busy_max_ns = ns;
+  {
+    uint64_t ms;
+    int i;
+    for (ms = ns/1000000, i = 0; ms && i < 7; i++)
+      ms >>= 1;
+    sd_emu_stats.busy_bins[i]++;
+  }
+  /* busy starts after the data response byte */
+  card.busy_ns = card.out_ns + byte_ns() + ns;
+}
+
+static void command(void)
+{
+  uint8_t c, r[5];
+  uint32_t arg;
+  int app;
+
+  sd_emu_stats.cmds++;
+  c = card.cmd[0] & 0x3f;
+  arg = ((uint32_t)card.cmd[1] << 24) | ((uint32_t)card.cmd[2] << 16) |
+    ((uint32_t)card.cmd[3] << 8) | card.cmd[4];
+  app = card.app;
+  card.app = 0;
+  card.state = ST_IDLE;
+
+  /* CRC is checked in SPI mode only for these, unless CMD59 */
+  if ((0 == c || 8 == c || card.crc_on)
+    && crc7(card.cmd, 5) != card.cmd[5]) {
+    respond1(R1_CRC | (card.initialised ? 0 : R1_IDLE));
+    return;
+  }
+
+  if (0 == c) {
+    card.initialised = 0;
+    card.crc_on = 0;
+    card.polls = 0;
+    card.pending_read = 0;
+    card.multi_read = 0;
+    respond1(R1_IDLE);
+    return;
+  }
+
+  r[0] = card.initialised ? 0 : R1_IDLE;
+
+  if (8 == c) {
+    r[1] = 0; r[2] = 0;
+    r[3] = (arg >> 8) & 0x0f;         /* voltage accepted */
+    r[4] = arg & 0xff;                /* check pattern */
+    respond(r, 5);
+    return;
+  }
+  if (55 == c) {
+    card.app = 1;
+    respond1(r[0]);
+    return;
+  }
+  if (58 == c) {
+    r[1] = (card.initialised ? 0x80 : 0) | 0x40; /* ready, CCS */
+    r[2] = 0xff; r[3] = 0x80; r[4] = 0x00;     /* 2.7-3.6V */
+    respond(r, 5);
+    return;
+  }
+  if (app && 41 == c) {
+    if (++card.polls >= sd_emu_model.init_polls)
+      card.initialised = 1;
+    respond1(card.initialised ? 0 : R1_IDLE);
+    return;
+  }
+  if (app && 13 == c && card.initialised) {   /* SD status */
+    r[1] = 0;                         /* R2 */
+    respond(r, 2);
+    card.status_read = 1;
+    card.pending_read = 1;
+    card.read_ns = card.out_ns + us_ns(sd_emu_model.read_us);
+    return;
+  }
+  if (59 == c) {                      /* CRC on/off */
+    card.crc_on = arg & 1;
+    respond1(r[0]);
+    return;
+  }
+  if (app && 23 == c) {               /* pre-erase hint, ignored */
+    respond1(r[0]);
+    return;
+  }
+  if (!card.initialised) {
+    respond1(R1_IDLE | R1_ILLEGAL);
+    return;
+  }
+  if (32 == c || 33 == c) {           /* erase start, end */
+    if (arg >= card.nr_blocks) {
+      respond1(R1_PARAM);
+      return;
+    }
+    if (32 == c) card.erase_start = arg; else card.erase_end = arg;
+    respond1(0);
+    return;
+  }
+  if (38 == c) {                      /* erase, R1b */
+    uint32_t a, au;
+    if (card.erase_end < card.erase_start) {
+      respond1(R1_PARAM);
+      return;
+    }
+    for (a = card.erase_start; a <= card.erase_end; a++)
+      card.erased[a/UNIT_BLOCKS] = 1;
+    au = au_blocks() ? au_blocks() : UNIT_BLOCKS;
+    respond1(0);
+    card.busy_ns = card.out_ns + 2*byte_ns() +
+      us_ns(sd_emu_model.erase_us) *
+      (card.erase_end/au - card.erase_start/au + 1);
+    return;
+  }
+  if (12 == c) {                      /* stop transmission */
+    card.multi_read = 0;
+    card.pending_read = 0;
+    r[0] = 0xa5;                      /* stuff byte */
+    r[1] = 0;
+    respond(r, 2);
+    return;
+  }
+  if (17 == c || 18 == c || 24 == c || 25 == c) {
+    if (arg >= card.nr_blocks) {
+      respond1(R1_PARAM);
+      return;
+    }
+    card.addr = arg;
+    respond1(0);
+    if (17 == c || 18 == c) {
+      card.multi_read = (18 == c);
+      card.pending_read = 1;
+      card.read_ns = card.out_ns + us_ns(sd_emu_model.read_us);
+    } else {
+      card.state = (24 == c) ? ST_WR_TOKEN : ST_MW_TOKEN;
+      card.au_partial = au_blocks() && (arg % au_blocks());
+      card.mw_first = 1;
+    }
+    return;
+  }
+  respond1(R1_ILLEGAL);
+}
+
+/* Data phase of CMD17: token, block, CRC */
+static void read_block(void)
+{
+  uint16_t crc;
+
+  card.pending_read = 0;
+  card.out[0] = 0xfe;
+  if (card.status_read) {             /* 64 bytes of SD status */
+    card.status_read = 0;
+    memset(card.out + 1, 0, 64);
+    card.out[1 + 10] = sd_emu_model.au_code << 4;
+    crc = crc16(card.out + 1, 64);
+    card.out[65] = crc >> 8;
+    card.out[66] = crc & 0xff;
+    card.out_len = 67;
+  } else if (card.addr >= card.nr_blocks
+    || blk_read(card.addr, card.out + 1)) {
+    card.out[0] = 0x01;               /* error token */
+    card.out_len = 1;
+    card.multi_read = 0;
+  } else {
+    crc = crc16(card.out + 1, 512);
+    card.out[513] = crc >> 8;
+    card.out[514] = crc & 0xff;
+    if (crc_err()) card.out[1 + 100] ^= 0x10;
+    card.out_len = 515;
+    sd_emu_stats.blocks_read++;
+  }
+  card.out_pos = 0;
+  card.out_ns = sd_emu_stats.now_ns;
+}
+
+static uint8_t shift_out(void)
+{
+  uint64_t now;
+
+  now = sd_emu_stats.now_ns;
+  if (card.out_pos < card.out_len) {
+    if (now < card.out_ns) return(0xff);
+    if (card.multi_read && 0xfe == card.out[0]
+      && card.out_pos + 1 == card.out_len) {
+      card.addr++;                    /* next block of CMD18 */
+      card.pending_read = 1;
+      card.read_ns = now + us_ns(sd_emu_model.mread_us);
+    }
+    return(card.out[card.out_pos++]);
+  }
+  if (card.pending_read) {
+    if (now < card.read_ns) return(0xff);
+    read_block();
+    return(card.out[card.out_pos++]);
+  }
+  if (now < card.busy_ns) return(0x00);
+  return(0xff);
+}
+
+static int busy(void)
+{
+  return(card.out_pos < card.out_len ||
+    sd_emu_stats.now_ns < card.busy_ns);
+}
+
+static void shift_in(uint8_t x)
+{
+  switch (card.state) {
+  case ST_IDLE:
+    if ((x & 0xc0) != 0x40) break;
+    card.state = ST_CMD;
+    card.cmd_len = 0;
+    /* fall through */
+  case ST_CMD:
+    card.cmd[card.cmd_len++] = x;
+    if (6 == card.cmd_len) command();
+    break;
+  case ST_WR_TOKEN:
+    if (busy()) break;
+    if (0xfe == x) {
+      card.state = ST_WR_DATA;
+      card.data_len = 0;
+    }
+    break;
+  case ST_MW_TOKEN:
+    if (busy()) break;
+    if (0xfc == x) {
+      card.state = ST_MW_DATA;
+      card.data_len = 0;
+    } else if (0xfd == x) {           /* stop tran */
+      card.state = ST_IDLE;
+      card.busy_ns = sd_emu_stats.now_ns + 2*byte_ns() +
+        us_ns(sd_emu_model.stop_us);
+    }
+    break;
+  case ST_WR_DATA:
+  case ST_MW_DATA:
+    card.data[card.data_len++] = x;
+    if (card.data_len < sizeof(card.data)) break;
+    card.state = (ST_WR_DATA == card.state) ? ST_IDLE : ST_MW_TOKEN;
+    block_received();
+    break;
+  }
+}
+
+/*
+  sd2.h interface
+ */
+
+int8_t sd_spi_init(void)
+{
+  card.fast = 0;
+  return(card.fd < 0 ? -1 : 0);
+}
+
+void sd_spi_reset(void)
+{
+  /* Card powered off with the SPI bus */
+  card.initialised = 0;
+  card.state = ST_IDLE;
+  card.out_len = card.out_pos = 0;
+  card.pending_read = 0;
+  card.multi_read = 0;
+  card.crc_on = 0;
+  card.busy_ns = 0;
+}
+
+void sd_go_fast(void) { card.fast = 1; }
+
+void sd_cs_lo(void) { card.cs = 1; }
+
+void sd_cs_hi(void)
+{
+  card.cs = 0;
+  if (ST_CMD == card.state) card.state = ST_IDLE;
+}
+
+static uint64_t poll_ns(void)
+{
+  return((uint64_t)sd_emu_model.poll_cycles * 1000 / 48);
+}
+
+/*
+  The SPI rx FIFO, 4 bytes as on the stm32f0; more are lost
+  (overrun).  With rx_lag, the byte just clocked in only gets to
+  the FIFO once waited for with rx_ready(), so a read of DR that
+  does not wait gets an older one, or the last again if empty.
+ */
+static struct {
+  uint8_t fifo[4];
+  uint8_t head, nr;
+  uint8_t last;                       /* read from DR */
+  uint8_t lagging, lag;               /* not yet in the FIFO */
+} rx;
+
+static void rx_push(uint8_t x)
+{
+  if (rx.nr >= sizeof(rx.fifo)) return;
+  rx.fifo[(rx.head + rx.nr++) % sizeof(rx.fifo)] = x;
+}
+
+/* RXNE, after waiting for any byte still on its way */
+static int rx_ready(void)
+{
+  if (rx.lagging) {
+    rx.lagging = 0;
+    rx_push(rx.lag);
+  }
+  return(rx.nr > 0);
+}
+
+static uint8_t rx_read(void)
+{
+  if (rx.nr) {
+    rx.last = rx.fifo[rx.head];
+    rx.head = (rx.head + 1) % sizeof(rx.fifo);
+    rx.nr--;
+  }
+  return(rx.last);
+}
+
+/* One byte on the wire, the byte received goes to the FIFO */
+static void xfer(uint8_t x)
+{
+  uint8_t res;
+
+  sd_emu_stats.xfers++;
+  sd_emu_stats.now_ns += byte_ns();
+  res = 0xff;
+  if (card.cs) {
+    res = shift_out();
+    shift_in(x);
+  }
+  card.crc_tx = crc16_add(card.crc_tx, x);
+  card.crc_rx = crc16_add(card.crc_rx, res);
+  if (!sd_emu_model.rx_lag) {
+    rx_push(res);
+    return;
+  }
+  (void)rx_ready();
+  rx.lagging = 1;
+  rx.lag = res;
+}
+
+/* As sd-arch.c: empty the FIFO, send, wait for RXNE, read */
+uint8_t sd_xfer(uint8_t x)
+{
+  sd_emu_stats.polls++;
+  sd_emu_stats.now_ns += poll_ns();
+  while (rx_ready())
+    (void)rx_read();
+  xfer(x);
+  (void)rx_ready();
+  return(rx_read());
+}
+
+/*
+  As sd-arch.c: the FIFO is emptied on changing the frame size,
+  then one frame is kept queued ahead of the one read.
+ */
+void sd_recv(uint8_t * buf, uint16_t len)
+{
+  uint64_t ns;
+  uint16_t n;
+
+  if (!sd_emu_model.frame16 || len < 4) {
+    for ( ; len > 0; len--)
+      *buf++ = sd_xfer(0xff);
+    return;
+  }
+  while (rx_ready())
+    (void)rx_read();
+  n = len/2;
+  xfer(0xff); xfer(0xff);
+  for ( ; n > 0; n--) {
+    if (n > 1) {
+      xfer(0xff); xfer(0xff);
+    }
+    sd_emu_stats.polls++;
+    ns = poll_ns();
+    if (ns > 2*byte_ns())
+      sd_emu_stats.now_ns += ns - 2*byte_ns();
+    (void)rx_ready();
+    *buf++ = rx_read();
+    *buf++ = rx_read();
+  }
+  while (rx_ready())
+    (void)rx_read();
+  if (len & 1) *buf = sd_xfer(0xff);
+}
+
+void sd_crc_start(void) { card.crc_tx = card.crc_rx = 0; }
+uint16_t sd_crc_tx(void) { return(card.crc_tx); }
+uint16_t sd_crc_rx(void) { return(card.crc_rx); }
+
+/*
+  By DMA on the target, so no waits, and the caller carries on
+  while the bytes go out.  They are clocked into the card at once,
+  then the clock is put back to when the DMA started; each poll of
+  sd_xmit_done() costs poll_cycles (at least a byte time) until it
+  catches up.
+ */
+static uint64_t xmit_end_ns;
+void sd_xmit(uint8_t * buf, uint16_t len)
+{
+  uint64_t ns;
+
+  ns = sd_emu_stats.now_ns;
+  for ( ; len > 0; len--)
+    xfer(*buf++);
+  while (rx_ready())                  /* as sd_xmit_done() */
+    (void)rx_read();
+  xmit_end_ns = sd_emu_stats.now_ns;
+  sd_emu_stats.now_ns = ns;
+}
+
+bool sd_xmit_done(void)
+{
+  uint64_t ns;
+
+  if (sd_emu_stats.now_ns >= xmit_end_ns) return(true);
+  sd_emu_stats.polls++;
+  ns = poll_ns();
+  sd_emu_stats.now_ns += (ns > byte_ns() ? ns : byte_ns());
+  return(false);
+}
+
+void sd_delay(uint8_t i) { sd_emu_stats.now_ns += us_ns(250) * i; }
+
+/*
+  Emulator control
+ */
+
+int sd_emu_open(char * fn, uint32_t mbytes)
+{
+  off_t size;
+
+  card.fd = open(fn, O_RDWR);
+  if (card.fd < 0) {
+    card.fd = open(fn, O_RDWR | O_CREAT, 0644);
+    if (card.fd < 0) return(-1);
+    if (ftruncate(card.fd, (off_t)mbytes << 20)) return(-1);
+  }
+  size = lseek(card.fd, 0, SEEK_END);
+  if (size < 512) return(-1);
+  card.nr_blocks = size / 512;
+  card.erased = calloc(card.nr_blocks/UNIT_BLOCKS + 1, 1);
+  if (!card.erased) return(-1);
+  card.rand = sd_emu_model.seed;
+  return(0);
+}
+
+void sd_emu_close(void)
+{
+  if (card.fd >= 0) close(card.fd);
+  card.fd = -1;
+  free(card.erased);
+  card.erased = 0;
+}
+
+int sd_emu_configure(char * s)
+{
+  static const struct { char * name; size_t off; } names[] = {
+#define N(f) { #f, offsetof(struct sd_emu_model, f) }
+    N(slow_hz), N(fast_hz), N(cmd_bytes), N(read_us), N(mread_us),
+    N(write_us),
+    N(stop_us), N(stall_every), N(stall_us), N(stall_ppm), N(seed),
+    N(au_code), N(au_copy_us), N(erase_us), N(au_erase_us),
+    N(crc_err_ppm), N(poll_cycles), N(frame16), N(rx_lag),
+#undef N
+  };
+  char * name, * value, * save;
+  char buf[256];
+  unsigned i;
+
+  strncpy(buf, s, sizeof(buf)-1);
+  buf[sizeof(buf)-1] = '\0';
+  for (name = strtok_r(buf, ",", &save); name;
+    name = strtok_r(0, ",", &save)) {
+    value = strchr(name, '=');
+    if (!value) return(-1);
+    *value++ = '\0';
+    if (!strcmp(name, "init_polls")) {
+      sd_emu_model.init_polls = strtoul(value, 0, 0);
+      continue;
+    }
+    for (i = 0; i < sizeof(names)/sizeof(*names); i++)
+      if (!strcmp(name, names[i].name)) break;
+    if (i >= sizeof(names)/sizeof(*names)) return(-1);
+    *(uint32_t *)((char *)&sd_emu_model + names[i].off) =
+      strtoul(value, 0, 0);
+  }
+  if (!sd_emu_model.cmd_bytes) sd_emu_model.cmd_bytes = 1;
+  card.rand = sd_emu_model.seed;
+  return(0);
+}
+
+void sd_emu_print_stats(void)
+{
+  struct sd_emu_stats * sp = &sd_emu_stats;
+  int i;
+  printf("emulated time   %.3f ms\n", sp->now_ns / 1e6);
+  printf("bytes clocked   %llu\n", (unsigned long long)sp->xfers);
+  printf("SPI polls       %llu\n", (unsigned long long)sp->polls);
+  printf("commands        %u\n", sp->cmds);
+  printf("blocks read     %u\n", sp->blocks_read);
+  printf("blocks written  %u\n", sp->blocks_written);
+  printf("stalls          %u\n", sp->stalls);
+  printf("crc errors      %u\n", sp->crc_errs);
+  printf("busy total      %.3f ms\n", sp->busy_ns / 1e6);
+  printf("busy max        %.3f ms\n", sp->busy_max_ns / 1e6);
+  printf("busy histogram  ");
+  for (i = 0; i < 8; i++)
+    printf(" %s%dms:%u", i < 7 ? "<" : ">=", i < 7 ? 1 << i : 64,
+      sp->busy_bins[i]);
+  printf("\n");
+}
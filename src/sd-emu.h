@@ -0,0 +1,79 @@
+#ifndef SD_EMU_H
+#define SD_EMU_H
+#include <stdint.h>
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Host (Linux) emulation of an SDHC card in SPI mode, backed by a
+  disk image file.  Provides the device specific functions
+  declared in sd2.h, in place of sd-arch.c, so sd2.c, fil.c,
+  wav.c and cfg.c run unchanged on the host.
+
+  Time is emulated: every byte through sd_xfer() advances the
+  clock by one SPI byte time, sd_delay() advances it by
+  i*0.25ms.  Each wait on the SPI also costs poll_cycles of CPU,
+  during which the SPI idles, unless sd_recv() is using 16 bit
+  frames, which keep it going.  Card latencies are expressed in
+  emulated time, so a busy card costs the caller SPI bytes, as on
+  the real thing.
+
+  Received bytes go through a model of the SPI rx FIFO, which
+  sd_xfer() and sd_recv() use as sd-arch.c does.  With rx_lag, a
+  byte is not there until waited for, as on the target, so code
+  that reads without waiting gets stale bytes here too.
+ */
+
+struct sd_emu_model {
+  uint32_t slow_hz;                   /* SPI clock before sd_go_fast() */
+  uint32_t fast_hz;                   /* and after */
+  uint32_t cmd_bytes;                 /* Ncr, 1..8 */
+  uint32_t read_us;                   /* Nac, command to data token */
+  uint32_t mread_us;                  /* CMD18, between data blocks */
+  uint32_t write_us;                  /* busy after each data block */
+  uint32_t stop_us;                   /* busy after stop tran token */
+  uint32_t stall_every;               /* every n'th block written... */
+  uint32_t stall_us;                  /* ...is busy this much longer */
+  uint32_t stall_ppm;                 /* random stalls per 1e6 blocks */
+  uint32_t seed;                      /* for random stalls */
+  uint32_t au_code;                   /* AU_SIZE in SD status, 9 = 4MB */
+  uint32_t au_copy_us;                /* leaving an AU written in part */
+  uint32_t erase_us;                  /* CMD38 busy, per AU */
+  uint32_t au_erase_us;               /* writing into an unerased AU */
+  uint32_t crc_err_ppm;               /* blocks corrupted on the bus */
+  uint32_t poll_cycles;               /* CPU per wait on the SPI, 48MHz */
+  uint32_t frame16;                   /* sd_recv() uses 16 bit frames */
+  uint32_t rx_lag;                    /* rx FIFO behind unless waited */
+  uint8_t init_polls;                 /* ACMD41 returns idle this often */
+};
+
+struct sd_emu_stats {
+  uint64_t now_ns;                    /* emulated time */
+  uint64_t xfers;                     /* bytes clocked, CS low or not */
+  uint64_t polls;                     /* waits on the SPI */
+  uint32_t cmds;
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  uint32_t stalls;
+  uint32_t crc_errs;                  /* blocks corrupted */
+  uint64_t busy_ns;                   /* total write busy time */
+  uint64_t busy_max_ns;               /* longest single busy */
+  uint32_t busy_bins[8];              /* <1ms, 1-2ms, 2-4ms... 64ms+ */
+};
+
+extern struct sd_emu_model sd_emu_model;
+extern struct sd_emu_stats sd_emu_stats;
+
+/*
+  Attach image file fn, which is created (sparse) with size
+  mbytes if it does not exist.  Returns 0 or -1 on error.
+ */
+extern int sd_emu_open(char * fn, uint32_t mbytes);
+extern void sd_emu_close(void);
+/*
+  Parse a comma separated list of model settings of the form
+  name=value (e.g. "write_us=300,stall_every=64,stall_us=120000")
+  into sd_emu_model.  Returns 0 or -1 on unknown name.
+ */
+extern int sd_emu_configure(char * s);
+extern void sd_emu_print_stats(void);
+
+#endif /* SD_EMU_H */
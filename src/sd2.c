@@ -2,7 +2,10 @@
   Copyright 2020 Harold Tay LGPLv3
   SD card access functions.  Arch specific functions in sd-spi.
  */
+#include <string.h>                   /* for memset() */
+#include <stdbool.h>
 #include "sd2.h"
+#include "ramfunc.h"
 
 #include "tx.h" /* XXX */
 #undef DBG_DEEP
@@ -31,7 +34,11 @@
 
 #endif
 
-uint8_t sd_buffer[512];
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS 2
+#endif
+static uint8_t cache_data[SD_CACHE_SECTORS][512] __attribute__((aligned(4)));
+uint8_t * sd_buffer = cache_data[0];
 
 /*
   For timeout purposes, assuming /2 and 8MHz, 1 byte takes 2us to
@@ -40,7 +47,7 @@ uint8_t sd_buffer[512];
   longer.
  */
 #define SKIP_MS(skip, ms) skip_(skip, ((uint16_t)ms)*90U)
-static uint8_t skip_(uint8_t skip, uint16_t x10bytes)
+RAMFUNC static uint8_t skip_(uint8_t skip, uint16_t x10bytes)
 {
   uint8_t i, res;
   do {
@@ -69,11 +76,52 @@ static void putdw(uint32_t dword)
 
 uint8_t sd_result;
 
-static uint8_t cmd(uint8_t c, uint32_t arg, uint8_t crc)
+/* 512 bytes at 12MHz is ~350us */
+#define XMIT_MAX_POLLS 100000UL
+static int8_t xmit_wait(void)
 {
+  uint32_t i;
+  for (i = XMIT_MAX_POLLS; i > 0; i--)
+    if (sd_xmit_done()) return(0);
+  return(SD_TMO_WRITEBLK);
+}
+
+#ifndef SD_CRC
+#define SD_CRC 0
+#endif
+bool sd_crc_on = SD_CRC;
+uint32_t sd_crc_errors;
+uint32_t sd_blocks_skipped;
+#define SD_CRC_RETRIES 2
+
+/* Commands are short, so their CRC7 is done in software */
+static uint8_t crc7(uint8_t crc, uint8_t x)
+{
+  uint8_t i;
+  crc ^= x;
+  for (i = 0; i < 8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ (0x09 << 1) : crc << 1;
+  return(crc);
+}
+
+/* Without the response */
+static void put_cmd(uint8_t c, uint32_t arg, uint8_t crc)
+{
+  if (sd_crc_on) {
+    crc = crc7(0, c|(1<<6));
+    crc = crc7(crc, arg >> 24);
+    crc = crc7(crc, arg >> 16);
+    crc = crc7(crc, arg >> 8);
+    crc = crc7(crc, arg) | 1;
+  }
   put(c|(1<<6));
   putdw(arg);
   put(crc);
+}
+
+static uint8_t cmd(uint8_t c, uint32_t arg, uint8_t crc)
+{
+  put_cmd(c, arg, crc);
 
   /* XXX Should skip anything with the high bit set? */
   sd_result = SKIP_MS(0xff, 50);
@@ -106,14 +154,16 @@ static int8_t appcmd(uint8_t c, uint32_t arg, uint8_t crc)
   return(SD_ERR_APPCMD55);
 }
 
-static int8_t card_init(void)
+static bool sd_card_known;            /* SDHC, OCR needn't be read */
+
+static int8_t card_init(bool warm)
 {
   uint8_t i, res;
 
   dbg(tx_puts("Entered card_init()\r\n"));
   sd_buffer_checkin(SD_ADDRESS_NONE);
 
-  (void)SKIP_MS(0xff, 1);
+  if (!warm) (void)SKIP_MS(0xff, 1);
 
   dbg(tx_puts("Sending CMD0\r\n"));
 
@@ -122,7 +172,7 @@ static int8_t card_init(void)
     if (1 == cmd(0, 0, 0x95)) break;
   }
 
-  (void)SKIP_MS(0xff, 20);
+  if (!warm) (void)SKIP_MS(0xff, 20);
 
   dbg(tx_puts("Sending CMD8\r\n"));
 
@@ -139,16 +189,24 @@ static int8_t card_init(void)
   if (res < 0) return(res);
   if (res) return(SD_ERR_ACMD);
 
-  dbg(tx_puts("Sending CMD58\r\n"));
+  if (!warm) {
+    dbg(tx_puts("Sending CMD58\r\n"));
 
-  for(i = 0; ; i++, sd_delay(i)) {
-    if (10 == i) return(SD_TMO_OCR58);
-    res = cmd(58, 0, 0);
-    if (1 == res || 0 == res) break;
+    for(i = 0; ; i++, sd_delay(i)) {
+      if (10 == i) return(SD_TMO_OCR58);
+      res = cmd(58, 0, 0);
+      if (1 == res || 0 == res) break;
+    }
+    /* XXX Response of cmd58 is R3 (R1 then 4 bytes) */
+
+    if (!(sd_response() & (1UL<<22))) return(SD_NOT_SDHC);
+    sd_card_known = true;
   }
-  /* XXX Response of cmd58 is R3 (R1 then 4 bytes) */
 
-  if (!(sd_response() & (1UL<<22))) return(SD_NOT_SDHC);
+  if (sd_crc_on) {
+    dbg(tx_puts("Sending CMD59\r\n"));
+    if (cmd(59, 1, 0)) return(SD_ERR_CRC_ON);
+  }
 
   dbg(tx_puts("card_init complete\r\n"));
 
@@ -171,7 +229,7 @@ int8_t sd_init(void)
     dbg(tx_puts("clocked\r\n"));
     sd_cs_lo();
     dbg(tx_puts("card_init..."));
-    res = card_init();
+    res = card_init(false);
     dbg_msg("init() returned ", res);
     sd_cs_hi();
     if (!res) break;
@@ -181,17 +239,32 @@ int8_t sd_init(void)
   return(res);
 }
 
+int8_t sd_reinit(void)
+{
+  int8_t j, res;
+
+  if (!sd_card_known) return(sd_init());
+  sd_spi_init();
+  sd_cs_hi();
+  for (j = 10; j > 0; j--)            /* at least 74 clocks */
+    (void)sd_xfer(0xff);
+  sd_cs_lo();
+  res = card_init(true);
+  sd_cs_hi();
+  dbg_msg("sd_reinit:card_init returned ", res);
+  if (res) return(sd_init());
+  sd_go_fast();
+  return(0);
+}
+
 static int8_t bread(uint32_t addr)
 {
   int8_t res;
-  uint16_t i;
 
   res = 0;
 
   sd_cs_lo();
-  put(17|(1<<6));
-  putdw(addr);
-  put(0);
+  put_cmd(17, addr, 0);
 
   sd_result = SKIP_MS(0xff, 300);
   if (0 != sd_result) {
@@ -205,10 +278,15 @@ static int8_t bread(uint32_t addr)
     goto done;
   }
 
-  for(i = 0; i < sizeof(sd_buffer); i++)  
-    sd_buffer[i] = sd_xfer(0xff);
+  if (sd_crc_on) sd_crc_start();
+  sd_recv(sd_buffer, 512);
 
-  putdw(0xffffffff);                  /* "CRC bytes" */
+  put(0xff); put(0xff);               /* CRC bytes */
+  if (sd_crc_on && sd_crc_rx()) {
+    sd_crc_errors++;
+    res = SD_ERR_CRC;
+  }
+  put(0xff); put(0xff);
 done:
   sd_cs_hi();
   if (res) { dbg_msg("bread error: ", res); }
@@ -217,8 +295,10 @@ done:
 
 int8_t sd_bread(uint32_t addr)
 {
-  int8_t res;
-  if ((res = bread(addr)))
+  int8_t res, i;
+  for (i = 0; i <= SD_CRC_RETRIES; i++)
+    if (SD_ERR_CRC != (res = bread(addr))) break;
+  if (res)
     if (!sd_init())
       res = bread(addr);
   return(res);
@@ -232,8 +312,7 @@ static int8_t bwrite(uint32_t addr)
   res = 0;
 
   sd_cs_lo();
-  put(24|(1<<6));
-  putdw(addr);
+  put_cmd(24, addr, 0);
 
   /*
     Need massive timeout after write_multiple_block?
@@ -250,14 +329,21 @@ static int8_t bwrite(uint32_t addr)
   }
 
   put(0xfe);                          /* start token */
-  for(i = 0; i < sizeof(sd_buffer); i++) {
-    (void)sd_xfer(sd_buffer[i]);
-  }
+  if (sd_crc_on) sd_crc_start();
+  sd_xmit(sd_buffer, 512);
+  res = xmit_wait();
+  if (res) goto done;
 
-  put(0);                             /* "CRC" */
-  put(0);
+  i = sd_crc_on ? sd_crc_tx() : 0;
+  put(i >> 8);                        /* CRC */
+  put(i & 0xff);
 
   sd_result = SKIP_MS(0xff, 700);
+  if (0x0b == (sd_result & 0x1f)) {
+    sd_crc_errors++;
+    res = SD_REJ_DATA_CRC;
+    goto done;
+  }
   if ((sd_result & 0x1f) != 5) {
     dbg_msg("bwrite:SD_ERR_WRITEBLK, sd_result=", sd_result);
     res = SD_ERR_WRITEBLK;
@@ -283,8 +369,10 @@ int8_t sd_bwrite(uint32_t addr)
 #warning SD_READONLY defined
   return(0);
 #else
-  int8_t res;
-  if ((res = bwrite(addr)))
+  int8_t res, i;
+  for (i = 0; i <= SD_CRC_RETRIES; i++)
+    if (SD_REJ_DATA_CRC != (res = bwrite(addr))) break;
+  if (res)
     if (!sd_init())
       res = bwrite(addr);
   return(res);
@@ -294,6 +382,20 @@ int8_t sd_bwrite(uint32_t addr)
 static int8_t failed(int8_t res) { sd_cs_hi(); return(res); }
 
 static int16_t bwrites_offset;        /* # payload bytes written in current sector */
+static uint16_t bwrites_xmit;         /* # going out by sd_xmit() */
+static bool bwrites_busy;             /* card programming last block */
+static uint32_t bwrites_polls;        /* while busy */
+static bool bwrites_stopping;         /* stop tran sent, card busy */
+static bool bwrites_ended;            /* stopped after the last block */
+static uint32_t bwrites_addr;         /* block being sent */
+static uint32_t bwrites_left;         /* blocks from there on */
+static uint8_t bwrites_tries;         /* resends of that block */
+
+/*
+  A busy card is polled with one byte per call of sd_bwrites_nb().
+  Give up after about as many bytes as SKIP_MS(0, 700) twice.
+ */
+#define BWRITES_MAX_POLLS (2*700UL*90*10)
 
 int8_t sd_bwrites_begin(uint32_t addr, uint32_t nr_sectors)
 {
@@ -307,56 +409,216 @@ int8_t sd_bwrites_begin(uint32_t addr, uint32_t nr_sectors)
   res = cmd(25, addr, 0);
   if (res) return(failed(SD_ERR_WR_MULTI));
 #endif
+  bwrites_addr = addr;
+  bwrites_left = nr_sectors;
   bwrites_offset = 0;
+  bwrites_xmit = 0;
+  bwrites_tries = 0;
+  bwrites_busy = false;
+  bwrites_stopping = false;
+  bwrites_ended = false;
 
   return(0);
 }
 
-int8_t sd_bwrites(uint8_t * buf, uint16_t len)
+/*
+  The card rejected a block for its CRC, and wrote nothing.  Stop
+  the transfer and start a new CMD25, at the same block to send it
+  again, or at the next (skip) if its data are no longer to hand.
+ */
+static int8_t bwrites_restart(uint8_t skip)
 {
+  uint8_t tries;
   int8_t res;
 
+  sd_xfer(0xfd);                      /* stop tran */
+  (void)SKIP_MS(0xff, 1);
+  if (!SKIP_MS(0x00, 700)) return(failed(SD_TMO_WRITEBLK2));
+  sd_cs_hi();
+  if (skip && 1 == bwrites_left) {   /* that was the last */
+    bwrites_ended = true;
+    return(0);
+  }
+  tries = bwrites_tries;
+  res = sd_bwrites_begin(bwrites_addr + skip,
+    bwrites_left ? bwrites_left - skip : 0);
+  bwrites_tries = tries;
+  return(res);
+}
+
+bool sd_bwrites_sending(void) { return(bwrites_xmit != 0); }
+
+/*
+  All 512 bytes of a data block are out: send its CRC and check
+  the card took it.  Returns 1 if it is to be sent again (only if
+  resend, the data still being to hand), 0 if taken or skipped.
+ */
+static int8_t bwrites_block_end(bool resend)
+{
+  uint16_t crc;
+  int8_t res, code;
+
+  crc = sd_crc_on ? sd_crc_tx() : 0;
+  sd_xfer(crc >> 8); sd_xfer(crc & 0xff);
+  res = SKIP_MS(0xff, 4);
+  if ((res & 0x1f) == 0x05) {
+    bwrites_busy = true;              /* skip "busy" next time */
+    bwrites_polls = 0;
+    bwrites_tries = 0;
+    bwrites_addr++;
+    if (bwrites_left) bwrites_left--;
+    return(0);
+  }
+  if ((res & 0x1f) == 0x0b) {
+    sd_crc_errors++;
+    if (resend && bwrites_tries < SD_CRC_RETRIES) {
+      bwrites_tries++;
+      res = bwrites_restart(0);
+      return(res ? res : 1);
+    }
+    dbg_msg("sd_bwrites_nb skipped block, tries ", bwrites_tries);
+    sd_blocks_skipped++;
+    bwrites_tries = 0;
+    return(bwrites_restart(1));
+  }
+  if (res == 0x0d) return(failed(SD_REJ_DATA_WRITE));
+  code = (res >> 1) & 0xf;
+  return(failed(SD_REJ_DATA - code));
+}
+
+/*
+  A piece of a data block is handed to sd_xmit() and left to go
+  out by itself: its bytes are only taken (and the block finished
+  off with the CRC) by a later call, once sd_xmit_done().
+  A block rejected for its CRC is sent again if it all came from
+  this buf[]; otherwise (part came with an earlier call), or after
+  SD_CRC_RETRIES, it is skipped and counted in sd_blocks_skipped.
+ */
+int8_t sd_bwrites_nb(uint8_t * buf, uint16_t * lenp)
+{
+  int8_t res;
+  uint16_t len, count;
+  uint8_t * block;                    /* start of it in buf[] */
+
+  len = *lenp;
+  *lenp = 0;
+  block = 0;
+
   while (len > 0) {
 #ifndef SIMULATE_MULTI
-    if (0 == bwrites_offset)          /* start a new data block */
-      sd_xfer(0xfc);                  /* start token */
-    sd_xfer(*buf++);
+    if (bwrites_xmit) {               /* from this buf[], last call */
+      if (!sd_xmit_done()) {
+        if (++bwrites_polls > XMIT_MAX_POLLS)
+          return(failed(SD_TMO_WRITEBLK));
+        return(SD_BUSY);
+      }
+      count = bwrites_xmit;
+      bwrites_xmit = 0;
+    } else {
+      if (0 == bwrites_offset) {      /* start a new data block */
+        if (bwrites_busy) {
+          if (0 == sd_xfer(0xff)) {
+            if (++bwrites_polls > BWRITES_MAX_POLLS)
+              return(failed(SD_TMO_WRITEBLK));
+            return(SD_BUSY);
+          }
+          bwrites_busy = false;
+        }
+        sd_xfer(0xfc);                /* start token */
+        if (sd_crc_on) sd_crc_start(); /* nothing else on SPI till done */
+      }
+      count = 512 - bwrites_offset;   /* rest of this data block */
+      if (count > len) count = len;
+      sd_xmit(buf, count);
+      if (!sd_xmit_done()) {
+        bwrites_xmit = count;
+        bwrites_polls = 0;
+        return(SD_BUSY);
+      }
+    }
+#else
+    count = 512 - bwrites_offset;
+    if (count > len) count = len;
 #endif
-    len--;
-    bwrites_offset++;
+    if (0 == bwrites_offset) block = buf;
+    buf += count;
+    len -= count;
+    *lenp += count;
+    bwrites_offset += count;
     if (512 == bwrites_offset) {
       bwrites_offset = 0;
 #ifndef SIMULATE_MULTI
-      sd_xfer(0xff); sd_xfer(0xff);   /* "crc" */
-      res = SKIP_MS(0xff, 4);
-      if ((res & 0x1f) != 0x05) {
-        int8_t code;
-        if (res == 0x0b) return(failed(SD_REJ_DATA_CRC));
-        if (res == 0x0d) return(failed(SD_REJ_DATA_WRITE));
-        code = (res >> 1) & 0xf;
-        return(failed(SD_REJ_DATA - code));
+      res = bwrites_block_end(0 != block);
+      if (res < 0) return(res);
+      if (res) {                      /* again, from the start */
+        len += buf - block;
+        *lenp -= buf - block;
+        buf = block;
       }
-      if (0xff != SKIP_MS(0, 700))    /* skip "busy" */
-        if (0xff != SKIP_MS(0, 700))
-          return(failed(SD_TMO_WRITEBLK));
+      block = 0;
 #endif
     }
   }
   return(0);
 }
 
+int8_t sd_bwrites(uint8_t * buf, uint16_t len)
+{
+  int8_t res;
+  uint16_t count;
+
+  for ( ; ; ) {
+    count = len;
+    res = sd_bwrites_nb(buf, &count);
+    if (SD_BUSY != res) return(res);
+    buf += count;
+    len -= count;
+  }
+}
+
 int8_t sd_bwrites_end(void)
 {
 #ifndef SIMULATE_MULTI
   int8_t res;
 
+  /*
+    What the caller last handed sd_bwrites_nb() may still be going
+    out: let it, and finish its block if it was the end of one
+    (with no way to send it again).
+   */
+  if (bwrites_xmit) {
+    res = xmit_wait();
+    if (res) return(failed(res));
+    bwrites_offset += bwrites_xmit;
+    bwrites_xmit = 0;
+    if (512 == bwrites_offset) {
+      bwrites_offset = 0;
+      res = bwrites_block_end(false);
+      if (res < 0) return(res);
+    }
+  }
+
   if (bwrites_offset) {               /* last sector not completed */
+    uint8_t zeroes[16];
     dbg_msg("sd_bwrites_end partial sector: ", bwrites_offset);
-    while (bwrites_offset < 512) {
-      sd_xfer(0x00);
-      bwrites_offset++;
+    memset(zeroes, 0, sizeof(zeroes));
+    while (bwrites_offset) {
+      uint16_t count;
+      count = 512 - bwrites_offset;
+      if (count > sizeof(zeroes)) count = sizeof(zeroes);
+      res = sd_bwrites_nb(zeroes, &count);
+      if (SD_BUSY == res) continue;
+      if (res) return(res);
     }
   }
+  if (bwrites_ended) return(0);       /* last block skipped, stopped */
+
+  if (bwrites_busy) {
+    if (0xff != SKIP_MS(0, 700))      /* skip "busy" */
+      if (0xff != SKIP_MS(0, 700))
+        return(failed(SD_TMO_WRITEBLK));
+    bwrites_busy = false;
+  }
 
   sd_xfer(0xfd);                      /* stop tran */
   (void)SKIP_MS(0xff, 700);
@@ -371,35 +633,258 @@ int8_t sd_bwrites_end(void)
 #endif
 }
 
+int8_t sd_bwrites_next_nb(uint32_t addr, uint32_t nr_sectors)
+{
+#ifndef SIMULATE_MULTI
+  if (bwrites_ended) return(sd_bwrites_begin(addr, nr_sectors));
+  if (bwrites_busy) {
+    if (0 == sd_xfer(0xff)) {
+      if (++bwrites_polls > BWRITES_MAX_POLLS)
+        return(failed(SD_TMO_WRITEBLK));
+      return(SD_BUSY);
+    }
+    bwrites_busy = false;
+  }
+  if (!bwrites_stopping) {
+    sd_xfer(0xfd);                    /* stop tran */
+    (void)SKIP_MS(0xff, 1);           /* until busy */
+    bwrites_stopping = true;
+    bwrites_polls = 0;
+  }
+  if (0 == sd_xfer(0xff)) {
+    if (++bwrites_polls > BWRITES_MAX_POLLS)
+      return(failed(SD_TMO_WRITEBLK2));
+    return(SD_BUSY);
+  }
+  sd_cs_hi();
+#endif
+  return(sd_bwrites_begin(addr, nr_sectors));
+}
+
+/*
+  Streaming read with CMD18.  The card keeps sending consecutive
+  blocks until sd_breads_end(), saving the command and access time
+  of a CMD17 per block.  CS stays low: nothing else may use the
+  card in between.
+ */
+static uint32_t breads_addr;          /* of the next block */
+int8_t sd_breads_begin(uint32_t addr)
+{
+  sd_cs_lo();
+  if (cmd(18, addr, 0)) return(failed(SD_ERR_RD_MULTI));
+  breads_addr = addr;
+  return(0);
+}
+
+/* A block with a bad CRC restarts the stream from that block */
+int8_t sd_breads(uint8_t * buf)
+{
+  uint8_t tries;
+  int8_t res;
+
+  for (tries = 0; ; tries++) {
+    sd_result = SKIP_MS(0xff, 500);
+    if (0xfe != sd_result) return(failed(SD_TMO_READBLKS));
+    if (sd_crc_on) sd_crc_start();
+    sd_recv(buf, 512);
+    put(0xff); put(0xff);             /* CRC bytes */
+    if (!sd_crc_on || !sd_crc_rx()) break;
+    sd_crc_errors++;
+    if (tries >= SD_CRC_RETRIES) return(failed(SD_ERR_CRC));
+    res = sd_breads_end();
+    if (res) return(res);
+    res = sd_breads_begin(breads_addr);
+    if (res) return(res);
+  }
+  breads_addr++;
+  return(0);
+}
+
+int8_t sd_breads_end(void)
+{
+  int8_t res;
+
+  sd_cs_lo();                         /* may have failed() */
+  put_cmd(12, 0, 0);
+  (void)get();                        /* stuff byte */
+  sd_result = SKIP_MS(0xff, 50);
+  res = (sd_result & 0x80) ? SD_ERR_STOP : 0;
+  if (!SKIP_MS(0x00, 100))            /* R1b busy */
+    res = SD_ERR_STOP;
+  sd_cs_hi();
+  return(res);
+}
+
+int8_t sd_erase(uint32_t first, uint32_t last)
+{
+  uint8_t i;
+
+  sd_cs_lo();
+  if (cmd(32, first, 0)) return(failed(SD_ERR_ERASE));
+  if (cmd(33, last, 0)) return(failed(SD_ERR_ERASE));
+  if (cmd(38, 0, 0)) return(failed(SD_ERR_ERASE));
+  for (i = 0; i < 120; i++)           /* R1b busy */
+    if (SKIP_MS(0, 500)) break;
+  sd_cs_hi();
+  return(i < 120 ? 0 : SD_TMO_ERASE);
+}
+
+/*
+  AU_SIZE is bits 431:428 of the 512 bit SD status.  Codes 1 to 9
+  are 16kB to 4MB in powers of 2, the rest are listed.
+ */
+static const uint32_t au_large_sectors[] = {
+  16384, 24576, 32768, 49152, 65536, 131072,   /* 8MB to 64MB */
+};
+uint32_t sd_au_code_sectors(uint8_t code)
+{
+  if (code >= 1 && code <= 9)
+    return(32UL << (code - 1));
+  if (code > 9 && code <= 15)
+    return(au_large_sectors[code - 10]);
+  return(0);
+}
+
+int8_t sd_au_sectors(uint32_t * sectorsp)
+{
+  uint8_t status[64];
+
+  *sectorsp = 0;
+  sd_cs_lo();
+  if (appcmd(13, 0, 0)) return(failed(SD_ERR_ACMD13));
+  (void)get();                        /* 2nd byte of R2 */
+  sd_result = SKIP_MS(0xff, 100);
+  if (0xfe != sd_result) return(failed(SD_TMO_STATUS));
+  if (sd_crc_on) sd_crc_start();
+  sd_recv(status, sizeof(status));
+  put(0xff); put(0xff);               /* CRC bytes */
+  sd_cs_hi();
+  if (sd_crc_on && sd_crc_rx()) {
+    sd_crc_errors++;
+    return(SD_ERR_CRC);
+  }
+
+  *sectorsp = sd_au_code_sectors(status[10] >> 4);
+  return(0);
+}
+
 /*
-  sd_buffer[] can support different users.  sd_buffer_checkout(addr)
-  fills the buffer from addr after first saving its current
-  contents.  sd_buffer_checkin(addr) relinquishes the buffer, whose
-  contents are from addr.
+  sd_buffer[] can support different users.  It points into a small
+  write back cache of SD_CACHE_SECTORS sectors.
+  sd_buffer_checkout(addr) makes the sector at addr current,
+  reading it in if not already cached, first evicting the least
+  recently used entry (and writing it back if dirty).  Whoever
+  modifies sd_buffer[] must call sd_buffer_dirty().
+  sd_buffer_checkin(addr) relinquishes the buffer, whose contents
+  are from addr.  sd_buffer_sync() writes back all dirty entries.
  */
-uint32_t current_address = SD_ADDRESS_NONE;
+#define CACHE_VALID 1
+#define CACHE_DIRTY 2
+static struct {
+  uint32_t addr;
+  uint32_t used;                      /* LRU stamp */
+  uint8_t flags;
+} cache[SD_CACHE_SECTORS];
+static uint8_t current;
+static uint32_t cache_clock;
+uint32_t sd_cache_hits, sd_cache_misses, sd_cache_writebacks;
+
+static int8_t writeback(uint8_t i)
+{
+  uint8_t * save;
+  int8_t res;
+
+  if (!(cache[i].flags & CACHE_DIRTY)) return(0);
+  save = sd_buffer;
+  sd_buffer = cache_data[i];
+  res = sd_bwrite(cache[i].addr);
+  sd_buffer = save;
+  if (res) return(res);
+  cache[i].flags &= ~CACHE_DIRTY;
+  sd_cache_writebacks++;
+  return(0);
+}
+
+static void make_current(uint8_t i)
+{
+  current = i;
+  sd_buffer = cache_data[i];
+  cache[i].used = ++cache_clock;
+}
+
 int8_t sd_buffer_sync(void)
 {
-  return (current_address == SD_ADDRESS_NONE?
-          0:
-          sd_bwrite(current_address));
+  uint8_t i;
+  int8_t res;
+
+  for (i = 0; i < SD_CACHE_SECTORS; i++)
+    if ((res = writeback(i))) return(res);
+  return(0);
 }
+
 int8_t sd_buffer_checkout(uint32_t addr)
 {
+  uint8_t i, victim;
   int8_t res;
-  if (addr != current_address) {
-    res = sd_buffer_sync();
-    if (res) return(res);
-    if (addr != SD_ADDRESS_NONE) {
-      res = sd_bread(addr);
-      if (res) return(res);
+
+  victim = 0;
+  for (i = 0; i < SD_CACHE_SECTORS; i++) {
+    if (!(cache[i].flags & CACHE_VALID)) {
+      victim = i;
+      if (SD_ADDRESS_NONE == addr) break;
+      continue;
+    }
+    if (cache[i].addr == addr) {
+      make_current(i);
+      sd_cache_hits++;
+      return(0);
     }
-    current_address = addr;
+    if ((cache[victim].flags & CACHE_VALID)
+      && cache[i].used < cache[victim].used)
+      victim = i;
+  }
+
+  res = writeback(victim);
+  if (res) return(res);
+  cache[victim].flags = 0;
+  make_current(victim);
+  if (addr != SD_ADDRESS_NONE) {
+    sd_cache_misses++;
+    res = sd_bread(addr);
+    if (res) return(res);
+    cache[victim].addr = addr;
+    cache[victim].flags = CACHE_VALID;
   }
   return(0);
 }
 
+void sd_buffer_discard(uint32_t addr, uint32_t nr)
+{
+  uint8_t i;
+
+  for (i = 0; i < SD_CACHE_SECTORS; i++)
+    if ((cache[i].flags & CACHE_VALID)
+      && cache[i].addr - addr < nr)
+      cache[i].flags = 0;
+}
+
+void sd_buffer_dirty(void)
+{
+  if (cache[current].flags & CACHE_VALID)
+    cache[current].flags |= CACHE_DIRTY;
+}
+
 void sd_buffer_checkin(uint32_t addr)
 {
-  current_address = addr;
+  uint8_t i;
+
+  if (SD_ADDRESS_NONE == addr) {
+    cache[current].flags = 0;
+    return;
+  }
+  for (i = 0; i < SD_CACHE_SECTORS; i++)
+    if (cache[i].addr == addr)
+      cache[i].flags = 0;
+  cache[current].addr = addr;
+  cache[current].flags = CACHE_VALID | CACHE_DIRTY;
 }
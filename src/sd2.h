@@ -1,6 +1,7 @@
 #ifndef SD_H
 #define SD_H
 #include <stdint.h>
+#include <stdbool.h>
 /*
   Copyright 2020 Harold Tay LGPLv3
   SD card functions.
@@ -12,11 +13,32 @@ extern void sd_go_fast(void);         /* speed up after sd_spi_init() */
 extern void sd_cs_lo(void);
 extern void sd_cs_hi(void);
 extern uint8_t sd_xfer(uint8_t x);    /* transfer over spi */
+/*
+  Start sending len bytes from buf, discarding whatever comes
+  back.  Used for data blocks, may be done by DMA, so may return
+  before they are all out: poll sd_xmit_done() until true before
+  touching buf or doing anything else on the SPI.
+ */
+extern void sd_xmit(uint8_t * buf, uint16_t len);
+extern bool sd_xmit_done(void);
+/*
+  Receive len bytes into buf, sending 0xff.  Used for data blocks,
+  may be done in 16 bit frames.
+ */
+extern void sd_recv(uint8_t * buf, uint16_t len);
 /*
   Delay for approx. i*0.25ms.  This is only used during init, so
   busy looping is ok.
  */
 extern void sd_delay(uint8_t i);
+/*
+  CRC16 (CCITT, as on SD data blocks) of the bytes sent and
+  received since sd_crc_start(), by the SPI's CRC unit.  Running
+  the received CRC over a block and its CRC gives 0 if good.
+ */
+extern void sd_crc_start(void);
+extern uint16_t sd_crc_tx(void);
+extern uint16_t sd_crc_rx(void);
 
 extern uint8_t sd_result;             /* contains last result... */
 #define SD_TMO_IDLESTATE0 -2
@@ -40,28 +62,113 @@ extern uint8_t sd_result;             /* contains last result... */
   Values from SD_REJ_DATA to SD_REJ_DATA + 15 indicate cause of
   rejection.  Don't use these values.
  */
+#define SD_ERR_RD_MULTI   -34
+#define SD_TMO_READBLKS   -35
+#define SD_ERR_STOP       -36
+#define SD_ERR_ACMD13     -37
+#define SD_TMO_STATUS     -38
+#define SD_ERR_ERASE      -39
+#define SD_TMO_ERASE      -40
+#define SD_ERR_CRC_ON     -41
+#define SD_ERR_CRC        -42
+
+/*
+  If sd_crc_on (initially SD_CRC, default 0) when sd_init() is
+  called, the card is put in CRC mode (CMD59) and data blocks are
+  sent and checked with real CRCs.  Reads with bad CRCs are
+  retried, sd_crc_errors counts every one seen.  So are blocks
+  of a multi-block write, if the data are still to hand; those
+  that cannot be are left unwritten and counted in
+  sd_blocks_skipped.
+ */
+extern bool sd_crc_on;
+extern uint32_t sd_crc_errors;
+extern uint32_t sd_blocks_skipped;
 extern int8_t sd_init(void);
-extern uint8_t sd_buffer[512];        /* all I/O to/from this */
+/*
+  After the card has been powered off, e.g. in STOP mode.  Once
+  sd_init() has seen an SDHC card it is assumed to be the same
+  one: fewer clocks, no settling waits and no OCR (CMD58).  Falls
+  back to sd_init() if that fails.
+ */
+extern int8_t sd_reinit(void);
+extern uint8_t * sd_buffer;           /* all I/O to/from this */
 extern int8_t sd_bread(uint32_t addr);
 extern int8_t sd_bwrite(uint32_t addr);
 extern int8_t sd_bwrites_begin(uint32_t addr, uint32_t nr_sectors);
 extern int8_t sd_bwrites(uint8_t * buf, uint16_t len);
+/*
+  As sd_bwrites(), but does not wait for the card to finish
+  programming a block, nor for a block to go out by sd_xmit().
+  Takes as much of buf[] as it can; *lenp is updated with the
+  number of bytes taken.  Returns SD_BUSY if the card was busy
+  or bytes are still going out (call again later with the rest,
+  which must be the same buf[] if sd_bwrites_sending()), 0 if all
+  were taken, < 0 on error.
+ */
+#define SD_BUSY 1
+extern int8_t sd_bwrites_nb(uint8_t * buf, uint16_t * lenp);
+extern bool sd_bwrites_sending(void);
 extern int8_t sd_bwrites_end(void);
+/*
+  As sd_bwrites_end() then sd_bwrites_begin(addr, nr_sectors), but
+  returns SD_BUSY instead of waiting for the card to finish the
+  last block and the stop tran; call again until it does not.
+  The last sector must be complete.
+ */
+extern int8_t sd_bwrites_next_nb(uint32_t addr, uint32_t nr_sectors);
+/*
+  Read consecutive blocks from addr with one CMD18.  Each call of
+  sd_breads() gets the next block into buf[512].  The card may not
+  be used for anything else until sd_breads_end().
+ */
+extern int8_t sd_breads_begin(uint32_t addr);
+extern int8_t sd_breads(uint8_t * buf);
+extern int8_t sd_breads_end(void);
+/*
+  Allocation unit size in sectors, from the SD status (ACMD13),
+  or 0 if the card does not say.
+ */
+extern int8_t sd_au_sectors(uint32_t * sectorsp);
+/* The same, from the AU_SIZE code, 0 to 15 */
+extern uint32_t sd_au_code_sectors(uint8_t code);
+/*
+  Erase blocks first to last inclusive (CMD32, CMD33, CMD38),
+  waiting up to a minute for the card to finish.
+ */
+extern int8_t sd_erase(uint32_t first, uint32_t last);
 
 #define SD_ADDRESS_NONE (uint32_t)-1
 /*
+  sd_buffer points to the current entry of a write back cache of
+  SD_CACHE_SECTORS (default 2) 512 byte sectors.
   Check out the data previously checked in under the same
-  address.
+  address; sd_buffer then points to it, until the next checkout.
+  Checking out SD_ADDRESS_NONE gets a scratch buffer.
  */
 extern int8_t sd_buffer_checkout(uint32_t addr);
 /*
-  Give the current buffer a new address.
+  Mark the current buffer as modified, so it is written back
+  when evicted or synced.
+ */
+extern void sd_buffer_dirty(void);
+/*
+  Forget any cached copies of sectors addr..addr+nr-1, dirty or
+  not, which are about to be overwritten on the card.
+ */
+extern void sd_buffer_discard(uint32_t addr, uint32_t nr);
+/*
+  Give the current buffer a new address (SD_ADDRESS_NONE to
+  discard it).
  */
 extern void sd_buffer_checkin(uint32_t addr);
 
 /*
-  Sync the current sector to disk.
+  Write all dirty sectors to disk.
  */
 extern int8_t sd_buffer_sync(void);
 
+/* Cache statistics, never reset by sd2.c */
+extern uint32_t sd_cache_hits, sd_cache_misses, sd_cache_writebacks;
+
 #endif /* SD_H */
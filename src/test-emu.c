@@ -0,0 +1,475 @@
+/*
+  Copyright 2020 Harold Tay GPLv3
+  Host test: run fil, cfg and wav against the SD card emulator.
+  Optionally formats a FAT32 image, copies the config file onto
+  it if not already there, parses it, then records a wav file with
+  the firmware's sector loop (rec.c) from pcm1808_buf, filled by
+  an emulated DMA, reporting dropped sectors and card statistics
+  in emulated time.
+
+  Usage: test-emu [-f] [-e] [-c] [-k] [-b] [-1] [-u pct] [-g clusters]
+    [-m model] [-s seconds] [-r boots] image config.LOG
+  -u makes the format fill pct% of the card with FILL.BIN, so
+  that finding free space has to scan the FAT.  With -g, FILL.BIN
+  leaves a hole of that many clusters after every so many it
+  uses, so a long recording has to be made of several runs.
+  -e sets wav_pre_erase, to erase the file before recording.
+  -c sets sd_crc_on, for CRC checked transfers.
+  -k sets wav_marks, to mark overruns as cue points in the wav.
+  -1 records mono, the left channel, as add_mono() does.
+  -b only compares reading sectors with 8 and 16 bit SPI frames,
+  and checks what is read (try -m rx_lag=1, and -c).
+  -r boots and records that many times, a minute apart, starting
+  each from fil_init() with nothing cached, as after a reset, so
+  each finds its free space from what the last left in FSInfo
+  (try -f -u 100 -g 512 -s 60 -r 2).
+ */
+#define _XOPEN_SOURCE 700
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sd2.h"
+#include "sd-emu.h"
+#include "fil.h"
+#include "cfg.h"
+#include "wav.h"
+#include "rtc.h"
+#include "tx.h"
+#include "trace.h"
+#include "pcm1808.h"
+#include "rec.h"
+
+#define IMAGE_MBYTES     256
+#define PART_START       2048
+#define SECTORS_PER_CLUS 8
+#define MIN_RESERVED     32
+#define ALIGN            8192         /* data area on a 4MB boundary */
+
+static void put16(uint8_t * p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t * p, uint32_t v)
+{
+  put16(p, v & 0xffff);
+  put16(p + 2, v >> 16);
+}
+
+static int wr(FILE * fp, uint32_t sector, uint8_t * buf)
+{
+  if (fseeko(fp, (off_t)sector * 512, SEEK_SET)) return(-1);
+  return(fwrite(buf, 512, 1, fp) == 1 ? 0 : -1);
+}
+
+/*
+  Minimal FAT32 format: MBR with one partition, boot sector,
+  FSInfo, two FATs, and a root directory in cluster 2, empty but
+  for FILL.BIN taking pct% of the clusters, less holes of gap
+  clusters every gap clusters if gap is not 0.
+ */
+#define IS_HOLE(c) (gap && (((c) - 3)/gap) % 2)
+static int format(char * fn, uint32_t mbytes, uint32_t pct, uint32_t gap)
+{
+  uint8_t b[512];
+  uint32_t total, fatsz, clusters, fill, used, reserved, i, c, next;
+  FILE * fp;
+
+  fp = fopen(fn, "w+");
+  if (!fp) return(-1);
+  if (ftruncate(fileno(fp), (off_t)mbytes << 20)) return(-1);
+
+  total = (mbytes << 11) - PART_START;
+  for (fatsz = 1; ; fatsz++) {
+    clusters = (total - MIN_RESERVED - 2*fatsz) / SECTORS_PER_CLUS;
+    if ((clusters + 2) * 4 <= fatsz * 512) break;
+  }
+  /* As the SD formatter does, so clusters line up with AUs */
+  reserved = MIN_RESERVED +
+    (ALIGN - (PART_START + MIN_RESERVED + 2*fatsz) % ALIGN) % ALIGN;
+  clusters = (total - reserved - 2*fatsz) / SECTORS_PER_CLUS;
+
+  memset(b, 0, sizeof(b));
+  b[446 + 4] = 0x0c;                  /* FAT32 LBA */
+  put32(b + 446 + 8, PART_START);
+  put32(b + 446 + 12, total);
+  b[510] = 0x55; b[511] = 0xaa;
+  if (wr(fp, 0, b)) return(-1);
+
+  memset(b, 0, sizeof(b));
+  b[0] = 0xeb; b[1] = 0x58; b[2] = 0x90;
+  memcpy(b + 3, "KINABALU", 8);
+  put16(b + 0x0b, 512);
+  b[0x0d] = SECTORS_PER_CLUS;
+  put16(b + 0x0e, reserved);
+  b[0x10] = 2;
+  b[0x15] = 0xf8;
+  put32(b + 0x1c, PART_START);
+  put32(b + 0x20, total);
+  put32(b + 0x24, fatsz);
+  put32(b + 0x2c, 2);                 /* root directory cluster */
+  put16(b + 0x30, 1);                 /* FSInfo sector */
+  put16(b + 0x32, 6);                 /* backup boot sector */
+  b[0x40] = 0x80;
+  b[0x42] = 0x29;
+  memcpy(b + 0x47, "NO NAME    FAT32   ", 19);
+  b[510] = 0x55; b[511] = 0xaa;
+  if (wr(fp, PART_START, b)) return(-1);
+  if (wr(fp, PART_START + 6, b)) return(-1);
+
+  memset(b, 0, sizeof(b));
+  put32(b, 0x41615252);
+  put32(b + 484, 0x61417272);
+  put32(b + 488, 0xffffffff);         /* free count unknown */
+  put32(b + 492, 0xffffffff);         /* next free unknown */
+  put32(b + 508, 0xaa550000);
+  if (wr(fp, PART_START + 1, b)) return(-1);
+
+  fill = clusters * pct / 100;
+  for (used = 0, i = 0; i < 2; i++) {
+    for (c = 0; c < fill + 3; c++) {
+      if (!(c % 128)) memset(b, 0, sizeof(b));
+      if (c < 3) {
+        put32(b + 4*c, c ? 0x0fffffff : 0x0ffffff8);
+      } else if (!IS_HOLE(c)) {
+        next = c + 1;
+        if (IS_HOLE(next)) next += gap;
+        put32(b + 4*(c % 128), next > fill + 2 ? 0x0fffffff : next);
+        if (!i) used++;
+      }
+      if (127 == c % 128 || c == fill + 2)
+        if (wr(fp, PART_START + reserved + i*fatsz + c/128, b))
+          return(-1);
+    }
+  }
+  if (fill) {
+    memset(b, 0, sizeof(b));
+    memcpy(b, "FILL    BIN", 11);
+    put16(b + 26, 3);                 /* first cluster */
+    put32(b + 28, used * SECTORS_PER_CLUS * 512);
+    if (wr(fp, PART_START + reserved + 2*fatsz, b)) return(-1);
+  }
+  fclose(fp);
+  printf("Formatted %s, %u clusters, %u sectors per FAT\n",
+    fn, clusters, fatsz);
+  return(0);
+}
+
+/* Copy a host file into the root directory */
+static int copy_in(char * path)
+{
+  char fn[12], * base;
+  uint8_t buf[100];
+  struct fil f;
+  size_t n;
+  int8_t i, er;
+  FILE * fp;
+
+  base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  memset(fn, ' ', 11);
+  fn[11] = '\0';
+  for (i = 0; i < 8 && base[i] && base[i] != '.'; i++)
+    fn[i] = base[i];
+  if (base[i] == '.')
+    memcpy(fn + 8, base + i + 1, 3);
+  fil_sanitise(fn);
+
+  er = fil_open(fn, &f);
+  if (!er) return(0);                 /* already there */
+  er = fil_create(fn, 0, &f);
+  if (er) return(er);
+  fp = fopen(path, "r");
+  if (!fp) return(-1);
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    er = fil_append(&f, buf, n);
+    if (er) break;
+  }
+  fclose(fp);
+  if (!er) er = fil_save_dirent(&f, 0, true);
+  return(er);
+}
+
+/*
+  The I2S DMA: one stereo word pair per sample period into
+  pcm1808_buf[], circularly, counting halves filled as the
+  interrupts do.  Sample values are the sample index so the
+  result can be verified.  Run up to the present whenever the
+  sector loop looks at where it is.
+ */
+static uint64_t start_ns, record_ns;
+static uint32_t produced;             /* words */
+static void dma_run(void)
+{
+  uint64_t words;
+  words = (sd_emu_stats.now_ns - start_ns) * WAV_SPS * 2 / 1000000000ULL;
+  for ( ; produced < words; produced++)
+    pcm1808_buf[produced % PCM1808_BUFSZ] = produced / 2;
+  pcm1808_halves = produced / (PCM1808_BUFSZ/2);
+}
+
+uint16_t pcm1808_head(void)
+{
+  dma_run();
+  return(produced % PCM1808_BUFSZ);
+}
+
+/* Nothing to do until the DMA fills the next half: skip to then */
+void pcm1808_wait(void)
+{
+  uint64_t t;
+  dma_run();
+  if (pcm1808_next()) return;
+  t = start_ns +
+    ((uint64_t)(pcm1808_halves + 1)*(PCM1808_BUFSZ/2)*1000000000ULL +
+    WAV_SPS*2 - 1)/(WAV_SPS*2);
+  if (t > sd_emu_stats.now_ns)
+    sd_emu_stats.now_ns = t;
+  dma_run();
+}
+
+/*
+  Cost of reading a sector, by CPU waits on the SPI and emulated
+  time, with sd_recv() in 8 then 16 bit frames.  Cycles assume
+  poll_cycles (default 25) per wait, the SPI idling meanwhile
+  unless in 16 bit frames.  The sectors, in the gap before the
+  partition, are first written with a pattern that every read is
+  checked against, so a byte dropped or read late shows up.
+ */
+#define BENCH_SECTORS 1000
+static uint8_t pattern(uint32_t sector, uint16_t i)
+{
+  return(sector*7 + i + (i >> 8));
+}
+static int bench(void)
+{
+  uint64_t ns, polls;
+  uint32_t i, wrong;
+  uint16_t j;
+  uint8_t f;
+  int8_t er;
+
+  for (i = 1; i <= BENCH_SECTORS; i++) {
+    er = sd_buffer_checkout(SD_ADDRESS_NONE);
+    if (er) return(er);
+    for (j = 0; j < 512; j++)
+      sd_buffer[j] = pattern(i, j);
+    er = sd_bwrite(i);
+    if (er) return(er);
+  }
+  if (!sd_emu_model.poll_cycles) sd_emu_model.poll_cycles = 25;
+  for (f = 0; f < 2; f++) {
+    sd_emu_model.frame16 = f;
+    ns = sd_emu_stats.now_ns;
+    polls = sd_emu_stats.polls;
+    for (wrong = 0, i = 1; i <= BENCH_SECTORS; i++) {
+      er = sd_buffer_checkout(SD_ADDRESS_NONE);
+      if (!er) er = sd_bread(i);
+      if (er) return(er);
+      for (j = 0; j < 512; j++)
+        if (sd_buffer[j] != pattern(i, j)) break;
+      if (j < 512) wrong++;
+    }
+    ns = (sd_emu_stats.now_ns - ns)/BENCH_SECTORS;
+    polls = (sd_emu_stats.polls - polls)/BENCH_SECTORS;
+    printf("%2u bit frames: %4llu polls, %5llu cycles, %6.1f us per sector",
+      f ? 16 : 8, (unsigned long long)polls,
+      (unsigned long long)polls*sd_emu_model.poll_cycles, ns/1e3);
+    printf(", %u read wrong\n", wrong);
+    if (wrong) return(-1);
+  }
+  return(0);
+}
+
+/*
+  Every sector of pcm1808_buf, a run of PCM1808_SECTOR_WORDS/2
+  sample periods, should follow on from the one before; a jump
+  between them is a dropped sector, and one anywhere else is bad.
+  In stereo both channels have the same value.
+ */
+#define RUN_FRAMES (PCM1808_SECTOR_WORDS/2)
+static int verify(char * fn, uint8_t channels, uint32_t dropped)
+{
+  struct fil f;
+  uint32_t off, bad, gaps, cues[WAV_NR_MARKS], nr_cues, cued, i, k;
+  uint16_t * p, expect;
+  int8_t er;
+
+  er = fil_open(fn, &f);
+  if (er) return(er);
+  /* Cue points, if any, are the sample offsets of the gaps */
+  er = fil_seek(&f, 0);
+  if (er) return(er);
+  nr_cues = cued = 0;
+  if (!memcmp(sd_buffer + 36, "cue ", 4)) {
+    nr_cues = *(uint32_t *)(sd_buffer + 44);
+    if (nr_cues > WAV_NR_MARKS) nr_cues = WAV_NR_MARKS;
+    for (i = 0; i < nr_cues; i++)
+      cues[i] = *(uint32_t *)(sd_buffer + 48 + 24*i + 4);
+  }
+  if (fil_au_kbytes())
+    printf("AU %u kB, recording starts %u sectors into one\n",
+      fil_au_kbytes(), fil_sector_address(f.head) % (fil_au_kbytes()*2));
+  bad = gaps = 0;
+  expect = 0;
+  for (k = 0, off = 512; off < f.file_size; off += 512) {
+    uint16_t i, j;
+    er = fil_seek(&f, off);
+    if (er) return(er);
+    p = (uint16_t *)sd_buffer;
+    for (i = 0; i < 256; i += channels, k++) {
+      if (2 == channels && p[i + 1] != p[i]) bad++;
+      if (p[i] != expect) {
+        if (k % RUN_FRAMES) {
+          bad++;
+        } else {
+          gaps++;
+          for (j = 0; j < nr_cues; j++)
+            if (cues[j] == k) cued++;
+        }
+      }
+      expect = p[i] + 1;
+    }
+  }
+  printf("verify: %u bad words, %u gaps (%u sectors dropped)\n",
+    bad, gaps, dropped);
+  if (nr_cues)
+    printf("verify: %u cue points, %u at gaps\n", nr_cues, cued);
+  return(bad ? -1 : 0);
+}
+
+int main(int argc, char ** argv)
+{
+  char fn[12], lfn[27];
+  uint16_t seconds;
+  struct rec_stats rs;
+  struct rtc now;
+  int ch, flag_format, flag_bench, fill_pct, gap, boots;
+  uint8_t channels;
+  int8_t er;
+
+  flag_format = flag_bench = fill_pct = gap = 0;
+  seconds = 10;
+  boots = 1;
+  channels = 2;
+  while ((ch = getopt(argc, argv, "feckb1u:g:m:s:r:")) != -1) {
+    switch (ch) {
+    case 'f': flag_format = 1; break;
+    case 'e': wav_pre_erase = true; break;
+    case 'c': sd_crc_on = true; break;
+    case 'k': wav_marks = true; break;
+    case 'b': flag_bench = 1; break;
+    case '1': channels = 1; break;
+    case 'u': fill_pct = atoi(optarg); break;
+    case 'g': gap = atoi(optarg); break;
+    case 'm':
+      if (sd_emu_configure(optarg)) {
+        fprintf(stderr, "Bad model \"%s\"\n", optarg);
+        return(1);
+      }
+      break;
+    case 's': seconds = atoi(optarg); break;
+    case 'r': boots = atoi(optarg); break;
+    default:
+      fprintf(stderr,
+        "Usage: %s [-f] [-e] [-c] [-k] [-b] [-1] [-u pct] [-g clusters]"
+        " [-m model] [-s seconds] [-r boots] image config.LOG\n",
+        argv[0]);
+      return(1);
+    }
+  }
+  if (optind + 2 != argc) {
+    fprintf(stderr, "Need image and config file\n");
+    return(1);
+  }
+
+  if (flag_format && format(argv[optind], IMAGE_MBYTES, fill_pct, gap)) {
+    perror(argv[optind]);
+    return(1);
+  }
+  if (sd_emu_open(argv[optind], IMAGE_MBYTES)) {
+    perror(argv[optind]);
+    return(1);
+  }
+
+reboot:
+  er = fil_init();
+  tx_msg("fil_init returned ", er);
+  if (er) return(1);
+  if (flag_bench) return(bench() ? 1 : 0);
+
+  /* Card powered off, as in STOP mode, then brought back */
+  {
+    uint64_t t;
+    sd_spi_reset();
+    t = sd_emu_stats.now_ns;
+    er = sd_init();
+    printf("sd_init         %d, %.3f ms\n", er, (sd_emu_stats.now_ns - t)/1e6);
+    sd_spi_reset();
+    t = sd_emu_stats.now_ns;
+    er = fil_reinit();
+    printf("fil_reinit      %d, %.3f ms\n", er, (sd_emu_stats.now_ns - t)/1e6);
+    if (er) return(1);
+  }
+
+  er = copy_in(argv[optind + 1]);
+  tx_msg("copy_in returned ", er);
+  if (er) return(1);
+  {
+    uint32_t checkouts, reads;
+    checkouts = sd_cache_hits + sd_cache_misses;
+    reads = sd_emu_stats.blocks_read;
+    er = cfg_init(false);
+    tx_msg("cfg_init returned ", er);
+    if (er < 0) return(1);
+    printf("cfg_init        %u sector checkouts, %u blocks read\n",
+      sd_cache_hits + sd_cache_misses - checkouts,
+      sd_emu_stats.blocks_read - reads);
+  }
+
+  rtc_now(&now);
+  wav_make_names(&now, cfg_sitename, *cfg_unit - '0', fn, lfn);
+  start_ns = sd_emu_stats.now_ns;
+  trace_start();
+  er = wav_record(&now, fn, lfn, seconds, channels);
+  tx_msg("wav_record returned ", er);
+  if (er) return(1);
+  record_ns = sd_emu_stats.now_ns - start_ns;
+
+  start_ns = sd_emu_stats.now_ns;
+  produced = pcm1808_halves = pcm1808_tail = 0;  /* pcm1808_start() */
+  er = rec_sectors(1 == channels, &rs);
+  tx_msg("wav_add returned ", er);
+
+  cfg_log_attr("min_headroom", rs.min_headroom);
+  cfg_log_attr("dropped_sectors", rs.dropped);
+  cfg_log_attr("overruns", rs.overruns);
+  trace_log();
+  cfg_log_ulattr("sd_free_kbytes", fil_free_kbytes());
+  cfg_log_sync();
+  fil_sync_fat2();
+  fil_sync_fsinfo();
+  sd_buffer_sync();
+
+  printf("\n");
+  sd_emu_print_stats();
+  printf("cache           %u hits, %u misses, %u writebacks\n",
+    sd_cache_hits, sd_cache_misses, sd_cache_writebacks);
+  if (sd_crc_on)
+    printf("crc errors seen %u, %u blocks skipped\n",
+      sd_crc_errors, sd_blocks_skipped);
+  printf("wav_record      %.3f ms\n", record_ns / 1e6);
+  printf("dropped sectors %u in %u overruns\n", rs.dropped, rs.overruns);
+  printf("min headroom    %u of %u words\n", rs.min_headroom, PCM1808_BUFSZ);
+  printf("max busy        %.3f ms\n", rs.max_busy*500.0/WAV_SPS);
+  printf("asleep          %.1f%% of %.3f s\n",
+    100.0*rs.asleep*1365333/(sd_emu_stats.now_ns - start_ns),
+    (sd_emu_stats.now_ns - start_ns)/1e9);
+  if (1 != er) return(1);
+  if (verify(fn, channels, rs.dropped)) return(1);
+  if (--boots > 0) {
+    printf("\nReboot\n");
+    sd_emu_stats.now_ns += 60000000000ULL;
+    sd_buffer_discard(0, 0xffffffff);
+    goto reboot;
+  }
+  return(0);
+}
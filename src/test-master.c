@@ -26,6 +26,8 @@
 #include "delay.h"
 
 #include "sd2.h"
+#include "trace.h"
+#include "rec.h"
 
 #define REALLY_SLEEP_DEEP
 
@@ -68,40 +70,26 @@ static void record_sensors(void)
   cfg_log_ulattr("bosch_humidity", (bosch.humidity*25)/256);
 }
 
-static int8_t add_mono(uint16_t lwm, uint16_t hwm)
-{
-  static uint16_t tmpbuf[64];
-  uint8_t i;
-
-  if (lwm & 0x1) lwm++;
-
-  for (i = 0; lwm < hwm; ) {
-    tmpbuf[i] = pcm1808_buf[lwm];
-    lwm += 2;
-    i++;
-    if (i >= 64 || lwm >= hwm) {
-      int8_t er;
-      er = wav_add(tmpbuf, i);
-      if (er) return(er);
-      i = 0;
-    }
-  }
-  return(0);
-}
 static int8_t record(struct rtc * rp, uint16_t seconds, bool mono)
 {
   int8_t er;
-  uint16_t lwm, hwm, count;
+  uint8_t i;
+  uint32_t wake_ms;
+  struct rec_stats rs;
   char fn[12], lfn[27];
 
   tx_msg("record:mono=", mono);
   if (!read_sensors())
     record_sensors();
+  trace("ph_sensors");
   wav_make_names(rp, cfg_sitename, *cfg_unit - '0', fn, lfn);
   cfg_log_lit("recording to:");
   cfg_logs(fn);
   cfg_logs(lfn);
+  cfg_log_flush();
   sd_buffer_sync();
+  sd_cache_hits = sd_cache_misses = sd_cache_writebacks = 0;
+  trace("ph_names");
   er = wav_record(rp, fn, lfn, seconds, mono?1:2);
   if (er) {
     cfg_log_attr("wav_record_er", er);
@@ -114,50 +102,68 @@ static int8_t record(struct rtc * rp, uint16_t seconds, bool mono)
 
   /* No write to SD card until recording ends (no logging allowed) */
 
-  lwm = 0;
   er = pcm1808_start();
+  wake_ms = TICK_MS(tick_now());      /* tick 0 is wake up (or boot) */
+  trace("ph_adc");
   if (er) {
     cfg_log_attr("pcm1808_start_er", er);
     goto cleanup_return;
   }
 
-  for ( ; ; ) {
-    hwm = PCM1808_HEAD;
-    if (hwm < lwm)
-      hwm = PCM1808_BUFSZ;
-    count = hwm - lwm;
-    if (mono) {
-      er = add_mono(lwm, hwm);
-    } else {
-      er = wav_add(pcm1808_buf + lwm, count);
-    }
-    if (er) break;
-    lwm += count;
-    if (lwm == PCM1808_BUFSZ) lwm = 0;
-  }
+  er = rec_sectors(mono, &rs);
   if (1 == er) er = 0;                /* normal exit */
   cfg_log_attr("wav_add_error", er);
+  cfg_log_attr("min_headroom", rs.min_headroom);
+  cfg_log_attr("dropped_sectors", rs.dropped);
+  cfg_log_attr("overruns", rs.overruns);
+  cfg_log_ulattr("samples_lost",
+    (uint32_t)rs.dropped*(PCM1808_SECTOR_WORDS/2));
+  cfg_log_ulattr("wake_to_sample_ms", wake_ms);
+  trace_log();                        /* where wake_ms went */
+  cfg_log_ulattr("max_busy_ms", (rs.max_busy*500UL)/WAV_SPS);
+  for (i = 0; i < REC_NR_BUSY_BINS; i++)
+    if (rs.busy_bins[i])
+      cfg_log_ulattr(rec_busy_bin_names[i], rs.busy_bins[i]);
+  /* Of the time recording, about 733 ticks per second */
+  cfg_log_ulattr("asleep_pct",
+    (rs.asleep*100)/((uint32_t)seconds*733 + 1));
 
 fil_cleanup_return:
   /* tx_msg("fil_reinit returned ", fil_reinit()); */
 cleanup_return:
   pcm1808_stop();
+  cfg_log_ulattr("sd_cache_hits", sd_cache_hits);
+  cfg_log_ulattr("sd_cache_misses", sd_cache_misses);
+  cfg_log_ulattr("sd_cache_writebacks", sd_cache_writebacks);
+  if (sd_crc_on) {                    /* since boot */
+    cfg_log_ulattr("sd_crc_errors", sd_crc_errors);
+    cfg_log_ulattr("sd_blocks_skipped", sd_blocks_skipped);
+  }
   cfg_log_attr("record", er);
   cfg_log_attr("approx_sd_used_percent", fil_approx_sd_used_pct());
+  cfg_log_ulattr("sd_free_kbytes", fil_free_kbytes());
   if (!read_sensors())
     record_sensors();
   return(er);
 }
 
+/*
+  tick_init() resets TIM2, so wake up (or boot) is tick 0 and the
+  trace starts there.  TIM2 only runs once the clock is set up, so
+  the HSE and PLL start up is not in it.
+ */
 static uint32_t rcc_csr;
 static void clock_setup(void)
 {
   rcc_csr = RCC_CSR;
   rcc_clock_setup_in_hse_8mhz_out_48mhz();
+  tick_init();
+  trace_start();
   usart_setup(USART1, GPIOA, GPIO9, GPIO_AF1, 57600);
   wkup_init();
-  tick_init();
+  trace("ph_clock");
   power_on(POWER_MODE_MASTER);
+  trace("ph_power");
   tx_puts("RCC_CSR=");
   tx_puthex32(rcc_csr);
   tx_puts("\r\n");
@@ -165,10 +171,13 @@ static void clock_setup(void)
 
 static void go_to_sleep(void)
 {
-  delay_ms(150);                      /* Wait for tx buffer to flush? XXX */
+  cfg_log_flush();                    /* may grow the file */
+  fil_sync_fat2();
+  fil_sync_fsinfo();
   sd_buffer_sync();                   /* prevent log corruption */
   cfg_log_sync();
   sd_buffer_checkout(SD_ADDRESS_NONE);
+  tx_flush();                         /* USART stops in STOP mode */
 #ifdef REALLY_SLEEP_DEEP
   power_off();
   sd_spi_reset();                     /* GPIOs to input, 1.5mA XXX */
@@ -187,18 +196,23 @@ static void wake_up(void)
 {
 #ifdef REALLY_SLEEP_DEEP
   int8_t er, i;
-  clock_setup();
+  clock_setup();                      /* card powered 100ms already */
   for (i = 0; i < 4; i++) {
-    delay_ms(200);
     er = fil_reinit();
     if (!er) break;
     tx_msg("fil_reinit returned ", er);
+    delay_ms(200);
   }
   cfg_log_attr("fil_reinit", er);
+  trace("ph_sd");
+#else
+  tick_init();
+  trace_start();
 #endif
   cfg_log_attr("wkup_flag", wkup_flag);
   wkup_flag = 0;
   rtc_rearm();
+  trace("ph_wake");
 }
 
 static void safe_rtc_now(struct rtc * rp)
@@ -259,6 +273,7 @@ int main(void)
 
   cfg_log_lattr("rcc_csr", rcc_csr);  /* Find cause of reset */
   cfg_log_lattr("wav_sps", WAV_SPS);  /* compiled with sample rate? */
+  cfg_log_ulattr("sd_au_kbytes", fil_au_kbytes());
 
   er = bosch_init(&bosch, BOSCH_ADDR_PRI);
   if (er) er = bosch_init(&bosch, BOSCH_ADDR_SEC);
@@ -298,6 +313,7 @@ int main(void)
     er = rtc_now(&now);
     CFG_PANIC((er != 0), "rtc_now_error", er);
     cfg_log_attr("rtc_now_error", er);
+    trace("ph_boot");                 /* since ph_power */
     er = record(&now, 20, 1);
     CFG_PANIC((er != 0), "deployment_notes_record_error ", er);
     cfg_logs("Deployment notes recorded successfully");
@@ -351,6 +367,7 @@ int main(void)
     tx_msg("now.seconds=", now.seconds);
     tx_msg("duration=", duration);
     tx_msg("mono=", mono);
+    trace("ph_sched");
     if (0 == sleep_mins               /* If too far into the minute, */
       && now.seconds < 3) {           /* assume woke up accidentally */
       cfg_log_lit("active");
@@ -32,6 +32,8 @@ void tick_init(void)
   old_value = 0xffffffff;
 }
 
+uint16_t tick_now(void) { return(timer_get_counter(TIM2)); }
+
 bool tick_need_stamp(void)
 {
 #if 1
@@ -8,4 +8,10 @@
 
 extern void tick_init(void);
 extern bool tick_need_stamp(void);
+/*
+  Free running count, 48MHz/65536 so about 1.365ms per tick,
+  wrapping after 89s.  For timing things like SD card erases.
+ */
+extern uint16_t tick_now(void);
+#define TICK_MS(ticks) (((uint32_t)(uint16_t)(ticks)*1365UL)/1000)
 #endif /* TICK_H */
@@ -0,0 +1,48 @@
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Phase tracer, see trace.h.  Phases past TRACE_NR_PHASES are
+  lumped into the last.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "tick.h"
+#include "cfg.h"
+#include "trace.h"
+
+static char * names[TRACE_NR_PHASES];
+static uint16_t ticks[TRACE_NR_PHASES];
+static uint8_t nr_phases;
+static uint16_t last;
+
+void trace_start(void)
+{
+  nr_phases = 0;
+  last = tick_now();
+}
+
+void trace(char * name)
+{
+  uint16_t now;
+
+  now = tick_now();
+  if (nr_phases < TRACE_NR_PHASES) {
+    names[nr_phases] = name;
+    ticks[nr_phases++] = now - last;
+  } else
+    ticks[TRACE_NR_PHASES - 1] += now - last;
+  last = now;
+}
+
+void trace_log(void)
+{
+  uint32_t total;
+  uint8_t i;
+
+  for (total = 0, i = 0; i < nr_phases; i++) {
+    cfg_log_ulattr(names[i], TICK_MS(ticks[i]));
+    total += ticks[i];
+  }
+  if (nr_phases)
+    cfg_log_ulattr("ph_total", (total*1365UL)/1000);
+  trace_start();
+}
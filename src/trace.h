@@ -0,0 +1,20 @@
+#ifndef TRACE_H
+#define TRACE_H
+/*
+  Copyright 2020 Harold Tay LGPLv3
+  Phase tracer, timed by tick_now() (TIM2, about 1.365ms).
+  trace_start() begins a trace, each trace(name) then notes the
+  time since the one before under name.  trace_log() writes them
+  to the log as name=ms and begins again.  Names start "ph_", for
+  the host side summariser phases.c to pick out.
+ */
+
+#ifndef TRACE_NR_PHASES
+#define TRACE_NR_PHASES 16
+#endif
+
+extern void trace_start(void);
+extern void trace(char * name);       /* name must be a literal */
+extern void trace_log(void);
+
+#endif /* TRACE_H */
@@ -1,6 +1,11 @@
 /*
   Copyright 2020 Harold Tay LGPLv3
   Interrupt driven serial (uart) output.
+  On the STM32, characters go into a ring drained by the USART1
+  TXE interrupt, so printing costs no more than the copy.  When
+  the ring is full, tx_putc() either sends the oldest character
+  itself (waiting for the USART, as before) or, if tx_drop is
+  set, drops the new one and counts it in tx_dropped.
  */
 
 #include "tx.h"
@@ -15,13 +20,80 @@
 #define USART_BPS 57600
 #endif
 void tx_putc(char ch) { while( !(UCSR0A&_BV(UDRE0)) ); UDR0=ch; }
+void tx_flush(void) { }
+
+#elif defined(HOST)
+
+#define PROGMEM /* nothing */
+#define pgm_read_byte_near(x) *((x))
+#include <stdio.h>
+#include <stdbool.h>
+void tx_putc(char ch) { if ('\r' != ch) putchar(ch); }
+void tx_flush(void) { fflush(stdout); }
+bool tx_drop;
+uint16_t tx_dropped;
 
 #else
 
 #define PROGMEM /* nothing */
 #define pgm_read_byte_near(x) *((x))
 #include <libopencm3/stm32/usart.h>
-void tx_putc(char ch) { usart_send_blocking(USART1, ch); }
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+#include <stdbool.h>
+
+#ifndef TX_RING_SZ
+#define TX_RING_SZ 256                /* power of 2 */
+#endif
+#ifndef TX_DROP
+#define TX_DROP 0
+#endif
+bool tx_drop = TX_DROP;
+uint16_t tx_dropped;
+static char ring[TX_RING_SZ];
+static volatile uint16_t head, tail; /* free running */
+
+void usart1_isr(void)
+{
+  if (!(USART_ISR(USART1) & USART_ISR_TXE)) return;
+  if (head == tail) {
+    usart_disable_tx_interrupt(USART1);
+    return;
+  }
+  USART_TDR(USART1) = ring[tail++ % TX_RING_SZ];
+}
+
+void tx_putc(char ch)
+{
+  uint32_t masked;
+
+  if ((uint16_t)(head - tail) >= TX_RING_SZ) {
+    if (tx_drop) {
+      tx_dropped++;
+      return;
+    }
+    /*
+      Make room by sending the oldest ourselves.  Interrupts are
+      masked so the ISR cannot take it too, which also means this
+      works when called with interrupts masked.
+     */
+    masked = cm_mask_interrupts(1);
+    while (!(USART_ISR(USART1) & USART_ISR_TXE));
+    USART_TDR(USART1) = ring[tail++ % TX_RING_SZ];
+    cm_mask_interrupts(masked);
+  }
+  ring[head % TX_RING_SZ] = ch;
+  head++;
+  nvic_enable_irq(NVIC_USART1_IRQ);
+  usart_enable_tx_interrupt(USART1);
+}
+
+/* Not with interrupts masked */
+void tx_flush(void)
+{
+  while (head != tail);
+  while (!(USART_ISR(USART1) & USART_ISR_TC));
+}
 
 #endif
 
@@ -36,10 +108,26 @@ void tx_init(void)
 #endif
 }
 
-void tx_putdec(int16_t d) { tx_puts(fmt_i16d((int16_t)d)); }
-void tx_putdec32(int32_t d) { tx_puts(fmt_i32d(d)); }
-void tx_puthex(uint8_t x) { tx_puts(fmt_x(x)); }
-void tx_puthex32(uint32_t x) { tx_puts(fmt_32x(x)); }
+void tx_putdec(int16_t d)
+{
+  char buf[FMT_BUFSZ];
+  tx_puts(fmt_i16d_r(d, buf));
+}
+void tx_putdec32(int32_t d)
+{
+  char buf[FMT_BUFSZ];
+  tx_puts(fmt_i32d_r(d, buf));
+}
+void tx_puthex(uint8_t x)
+{
+  char buf[FMT_BUFSZ];
+  tx_puts(fmt_x_r(x, buf));
+}
+void tx_puthex32(uint32_t x)
+{
+  char buf[FMT_BUFSZ];
+  tx_puts(fmt_32x_r(x, buf));
+}
 void tx_msg(char * s, int16_t d)
 {
   tx_puts(s);
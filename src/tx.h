@@ -17,6 +17,12 @@ do { static const char s[] PROGMEM = lit; tx_putpgms(s); } while (0)
 #endif
 
 void tx_putc(char ch);
+void tx_flush(void);                  /* wait till all sent */
+#ifndef __AVR__
+#include <stdbool.h>
+extern bool tx_drop;                  /* not wait when buffer full */
+extern uint16_t tx_dropped;           /* chars lost to tx_drop */
+#endif
 void tx_puts(char * s);
 void tx_init(void);
 void tx_putdec(int16_t d);
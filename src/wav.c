@@ -13,6 +13,8 @@
 #include "wav.h"
 #include "fmt.h"
 #include "cfg.h"                      /* for cfg_log_lattr() */
+#include "tick.h"
+#include "trace.h"
 
 struct wav_header {
   uint32_t chunk_id;                  /* 0x46464952 (LE) */
@@ -26,9 +28,12 @@ struct wav_header {
   uint32_t byte_rate;                 /* 96000 (LE) */
   uint16_t block_align;               /* 2 (LE) */
   uint16_t bits_per_sample;           /* 16 */
+  uint32_t junk_id;                   /* 0x4b4e554a (LE) */
+  uint32_t junk_size;                 /* WAV_JUNK_SIZE (LE) */
+  uint8_t junk[460];                  /* pads header to one sector */
   uint32_t subchunk2_id;              /* 0x61746164 (LE) */
-  uint32_t subchunk2_size;            /* 5767168 - 44 */
-  /* raw data follows */
+  uint32_t subchunk2_size;            /* 5767168 - 512 */
+  /* raw data follows, sector aligned */
 };
 
 #define WAV_CHUNK_ID        0x46464952
@@ -39,12 +44,42 @@ struct wav_header {
 #define WAV_AUDIO_FORMAT    1
 #define WAV_BLOCK_ALIGN     2
 #define WAV_BITS_PER_SAMPLE 16
+#define WAV_JUNK_ID         0x4b4e554a
+#define WAV_JUNK_SIZE       sizeof(((struct wav_header *)0)->junk)
+#define WAV_CUE_ID          0x20657563
 #define WAV_SUBCHUNK2_ID    0x61746164
-/* #define WAV_SUBCHUNK2_SIZE  (5767168 - 44) */
+/* #define WAV_SUBCHUNK2_SIZE  (5767168 - 512) */
 
-static uint32_t wav_start_cluster;
+/*
+  The header fills exactly one sector, so every sector of samples
+  from pcm1808 lands on an SD block boundary.
+ */
+typedef char wav_header_is_one_sector
+  [sizeof(struct wav_header) == 512 ? 1 : -1];
+
+/*
+  The file is written as up to WAV_NR_RUNS runs of contiguous
+  sectors, each with its own multi-block write.  Moving from one
+  to the next is done by wav_add_nb() without waiting on the card.
+ */
+#ifndef WAV_NR_RUNS
+#define WAV_NR_RUNS 8
+#endif
+static struct fil_run wav_runs[WAV_NR_RUNS];
+static uint8_t wav_nr_runs, wav_run;
+static uint32_t wav_run_bytes;        /* left in wav_runs[wav_run] */
 static uint32_t wav_nr_bytes_remaining;
 static uint8_t wav_nr_channels;       /* either 1 or 2 only */
+#ifndef WAV_PRE_ERASE
+#define WAV_PRE_ERASE 0
+#endif
+bool wav_pre_erase = WAV_PRE_ERASE;
+#ifndef WAV_MARKS
+#define WAV_MARKS 0
+#endif
+bool wav_marks = WAV_MARKS;
+static uint32_t wav_mark_at[WAV_NR_MARKS]; /* sample offsets */
+static uint8_t wav_nr_marks;
 static struct fil wav_f;
 
 #ifndef WAV_SPS
@@ -143,18 +178,19 @@ void wav_make_names(struct rtc * rp, char site[5], uint8_t unit,
 int8_t wav_record(struct rtc * rp, char fn[11], char lfn[27],
   uint16_t seconds, uint8_t nr_channels)
 {
-  static struct wav_header w;
+  struct wav_header * w;
   int8_t er;
   uint32_t file_bytes;
 
   if (nr_channels < 1 || nr_channels > 2)
     nr_channels = 1;
   wav_nr_channels = nr_channels;
+  wav_nr_marks = 0;
 
   file_bytes = seconds * WAV_SPS * 2; /* 2 bytes per sample */
   file_bytes *= wav_nr_channels;
 
-  file_bytes += sizeof(w);
+  file_bytes += sizeof(*w);
   if (file_bytes & 0x000003ff) {      /* round up to nearest k */
     file_bytes += 1024;
     file_bytes &= ~(0x000003ff);
@@ -164,15 +200,18 @@ int8_t wav_record(struct rtc * rp, char fn[11], char lfn[27],
   if (er) return(er);
   er = sd_buffer_sync();
   if (er) return(er);
+  trace("ph_create");
 
-  er = fil_find_free_clusters(file_bytes/1024, &wav_start_cluster);
+  wav_nr_runs = WAV_NR_RUNS;
+  er = fil_find_free_runs(file_bytes/1024, wav_runs, &wav_nr_runs);
   if (er) {
-    dbg(tx_msg("wav_record:fil_find_free_clusters returned ", er));
+    dbg(tx_msg("wav_record:fil_find_free_runs returned ", er));
     return(er);
   }
-  wav_f.file_size = sizeof(w);
+  trace("ph_alloc");
+  wav_f.file_size = sizeof(*w);
 
-  wav_f.head = wav_start_cluster;
+  wav_f.head = wav_runs[0].cluster;
 
   /* more meaningful to use CREATION time */
   if (rp) {
@@ -194,68 +233,188 @@ int8_t wav_record(struct rtc * rp, char fn[11], char lfn[27],
     dbg(tx_msg("wav_record:sd_buffer_sync returned ", er));
     return(er);
   }
+  trace("ph_dirent");
 
   wav_f.file_size = wav_nr_bytes_remaining = file_bytes;
   cfg_log_lattr("bytes_to_write", file_bytes);
+  if (wav_nr_runs > 1)
+    cfg_log_attr("runs", wav_nr_runs);
+
+  if (wav_pre_erase) {
+    uint32_t first;
+    uint16_t t;
+    uint8_t i;
+    t = tick_now();
+    for (er = 0, i = 0; i < wav_nr_runs && !er; i++) {
+      first = fil_sector_address(wav_runs[i].cluster);
+      er = sd_erase(first, first + wav_runs[i].nr_sectors - 1);
+    }
+    cfg_log_lattr("erase_ms", TICK_MS(tick_now() - t));
+    if (er) cfg_log_attr("erase_er", er); /* carry on regardless */
+    trace("ph_erase");
+  }
 
   /*
-    From now, no longer using fil API and sd_buffer[] not used.
+    From now, no longer using fil API and sd_buffer[] is used only
+    to build the header.
     The complete file basically exists on disk, but contains rubbish.
    */
+  er = sd_buffer_checkout(SD_ADDRESS_NONE);
+  if (er) {
+    dbg(tx_msg("wav_record:sd_buffer_checkout returned ", er));
+    return(er);
+  }
 
-  er = sd_bwrites_begin(fil_sector_address(wav_start_cluster),
-    file_bytes/512);
+  wav_run = 0;
+  wav_run_bytes = wav_runs[0].nr_sectors*512;
+  if (wav_run_bytes > file_bytes) wav_run_bytes = file_bytes;
+  er = sd_bwrites_begin(fil_sector_address(wav_runs[0].cluster),
+    wav_run_bytes/512);
   if (er) {
     dbg(tx_msg("wav_record:sd_bwrites_begin returned ", er));
     return(er);
   }
 
-  w.chunk_id = WAV_CHUNK_ID;
-  w.chunk_size = file_bytes - 8;
-  w.format = WAV_FORMAT;
-  w.subchunk1_id = WAV_SUBCHUNK1_ID;
-  w.subchunk1_size = WAV_SUBCHUNK1_SIZE;
-  w.audio_format = WAV_AUDIO_FORMAT;
-  w.num_channels = wav_nr_channels;
-  w.sample_rate = WAV_SPS;
-  w.byte_rate = 2*WAV_SPS*wav_nr_channels;
-  w.block_align = wav_nr_channels * 2;
-  w.bits_per_sample = WAV_BITS_PER_SAMPLE;
-  w.subchunk2_id = WAV_SUBCHUNK2_ID;
-  w.subchunk2_size = file_bytes - 44;
-
-  er = wav_add((void *)&w, sizeof(w)/2);
+  w = (struct wav_header *)sd_buffer;
+  memset(w, 0, sizeof(*w));
+  w->chunk_id = WAV_CHUNK_ID;
+  w->chunk_size = file_bytes - 8;
+  w->format = WAV_FORMAT;
+  w->subchunk1_id = WAV_SUBCHUNK1_ID;
+  w->subchunk1_size = WAV_SUBCHUNK1_SIZE;
+  w->audio_format = WAV_AUDIO_FORMAT;
+  w->num_channels = wav_nr_channels;
+  w->sample_rate = WAV_SPS;
+  w->byte_rate = 2*WAV_SPS*wav_nr_channels;
+  w->block_align = wav_nr_channels * 2;
+  w->bits_per_sample = WAV_BITS_PER_SAMPLE;
+  w->junk_id = WAV_JUNK_ID;
+  w->junk_size = WAV_JUNK_SIZE;
+  w->subchunk2_id = WAV_SUBCHUNK2_ID;
+  w->subchunk2_size = file_bytes - sizeof(*w);
+
+  er = wav_add((void *)w, sizeof(*w)/2);
   if (er)
     dbg(tx_msg("wav_record:wav_add returned ", er));
+  trace("ph_header");
   return(er);
 }
 
-int8_t wav_add(uint16_t * buf, uint16_t word_count)
+/*
+  Start the next run once the card has finished the last.  Until
+  then the DMA ring takes up the slack, as for any busy card.
+ */
+static int8_t next_run(void)
 {
-  uint16_t byte_count;
+  uint32_t bytes;
   int8_t er;
 
-  byte_count = word_count * 2;
+  bytes = wav_runs[wav_run + 1].nr_sectors*512;
+  if (bytes > wav_nr_bytes_remaining) bytes = wav_nr_bytes_remaining;
+  er = sd_bwrites_next_nb(fil_sector_address(wav_runs[wav_run + 1].cluster),
+    bytes/512);
+  if (er) return(er);
+  wav_run++;
+  wav_run_bytes = bytes;
+  return(0);
+}
+
+void wav_mark(void)
+{
+  if (wav_nr_marks >= WAV_NR_MARKS) return;
+  wav_mark_at[wav_nr_marks++] =
+    (wav_f.file_size - wav_nr_bytes_remaining - sizeof(struct wav_header))/
+    (2*wav_nr_channels);
+}
+
+/*
+  Turn the header's JUNK chunk into a cue chunk, one cue point
+  per mark, followed by a smaller JUNK chunk to pad it out.
+  With WAV_NR_MARKS cue points of 24 bytes, there is just room
+  for the second JUNK chunk's id and size.
+ */
+typedef char wav_marks_fit
+  [4 + WAV_NR_MARKS*24 + 8 <= WAV_JUNK_SIZE ? 1 : -1];
+static int8_t put_marks(void)
+{
+  struct wav_header * w;
+  uint32_t addr, * p;
+  uint8_t i;
+  int8_t er;
+
+  addr = fil_sector_address(wav_runs[0].cluster);
+  sd_buffer_discard(addr, 1);         /* written round the cache */
+  er = sd_buffer_checkout(addr);
+  if (er) return(er);
+  w = (struct wav_header *)sd_buffer;
+  w->junk_id = WAV_CUE_ID;
+  w->junk_size = 4 + wav_nr_marks*24;
+  p = (uint32_t *)w->junk;
+  *p++ = wav_nr_marks;
+  for (i = 0; i < wav_nr_marks; i++) {
+    *p++ = i + 1;                     /* identifier */
+    *p++ = wav_mark_at[i];            /* position */
+    *p++ = WAV_SUBCHUNK2_ID;          /* in the data chunk */
+    *p++ = 0;                         /* chunk start */
+    *p++ = 0;                         /* block start */
+    *p++ = wav_mark_at[i];            /* sample offset */
+  }
+  *p++ = WAV_JUNK_ID;
+  *p = WAV_JUNK_SIZE - w->junk_size - 8;
+  sd_buffer_dirty();
+  return(sd_buffer_sync());
+}
+
+int8_t wav_add_nb(uint16_t * buf, uint16_t * countp)
+{
+  uint16_t byte_count, count;
+  int8_t er;
+
+  byte_count = *countp * 2;
   if (wav_nr_bytes_remaining < byte_count)
     byte_count = wav_nr_bytes_remaining;
+  *countp = 0;
 
-  er = sd_bwrites((void *)buf, byte_count);
-
-  if (er) {
+  do {
+    if (!wav_run_bytes && wav_nr_bytes_remaining) {
+      er = next_run();
+      if (SD_BUSY == er) return(WAV_BUSY);
+      if (er) {
+        dbg(tx_msg("wav_add:next_run returned ", er));
+        return(er);
+      }
+    }
+    count = byte_count;
+    if (wav_run_bytes < count)
+      count = wav_run_bytes;
+    er = sd_bwrites_nb((void *)buf, &count);
+    wav_nr_bytes_remaining -= count;
+    wav_run_bytes -= count;
+    byte_count -= count;
+    buf += count/2;
+    *countp += count/2;
+  } while (!er && byte_count);
+
+  if (er < 0) {
     dbg(tx_msg("wav_add:sd_bwrites returned ", er));
-    dbg(tx_msg("wav_add:sd_bwrites byte_count = ", byte_count));
+    dbg(tx_msg("wav_add:sd_bwrites byte_count = ", *countp * 2));
     dbg(tx_puts("bytes left = "));
     dbg(tx_putdec32(wav_nr_bytes_remaining));
     dbg(tx_puts("\r\n"));
     return(er);
   }
-  wav_nr_bytes_remaining -= byte_count;
+  if (SD_BUSY == er)
+    return(WAV_BUSY);
 
   if (wav_nr_bytes_remaining)
     return(0);
 
   er = sd_bwrites_end();
   if (er) return(er);
+  if (wav_marks && wav_nr_marks) {
+    er = put_marks();                 /* the samples are safe anyway */
+    if (er) dbg(tx_msg("wav_add:put_marks returned ", er));
+  }
   /*
     File is complete except for file size.
     wav_f.f.file_size has been updated.
@@ -268,3 +427,17 @@ int8_t wav_add(uint16_t * buf, uint16_t word_count)
   dbg(tx_puts("wav_add:completed writing, returning 1\r\n"));
   return(1);
 }
+
+int8_t wav_add(uint16_t * buf, uint16_t word_count)
+{
+  uint16_t count;
+  int8_t er;
+
+  for ( ; ; ) {
+    count = word_count;
+    er = wav_add_nb(buf, &count);
+    if (WAV_BUSY != er) return(er);
+    buf += count;
+    word_count -= count;
+  }
+}
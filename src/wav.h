@@ -37,6 +37,8 @@ extern int8_t wav_record(struct rtc * rp, char fn[11], char lfn[27],
   uint16_t duration_seconds, uint8_t nr_channels);
 
 /*
+  The header is one whole sector, so if count is always a whole
+  sector (256 words) the data stay aligned to SD blocks.
   Low word of buf[n] is left channel, high word is right
   channel.  If mono, then right channel (high word) is ignored.
   Returns 1 when file is complete, 0 if not yet complete, < 0 on
@@ -45,4 +47,31 @@ extern int8_t wav_record(struct rtc * rp, char fn[11], char lfn[27],
  */
 extern int8_t wav_add(uint16_t * buf, uint16_t count);
 
+/*
+  As wav_add(), but returns WAV_BUSY instead of waiting if the SD
+  card is busy.  *countp is updated with the number of words
+  taken from buf[], the rest must be offered again.
+ */
+#define WAV_BUSY 2
+extern int8_t wav_add_nb(uint16_t * buf, uint16_t * countp);
+
+/*
+  If set, wav_record() erases the whole file's sectors before
+  returning, so the card need not erase during the recording.
+  The time taken is logged as erase_ms.  Initially WAV_PRE_ERASE
+  (default 0).
+ */
+extern bool wav_pre_erase;
+
+/*
+  Note a gap in the samples (an overrun, samples lost) at the
+  point reached in the file.  If wav_marks is set (initially
+  WAV_MARKS, default 0), the first WAV_NR_MARKS gaps are put in
+  the header as cue points when the file is complete, so they
+  show up as markers in an audio editor.
+ */
+#define WAV_NR_MARKS 18               /* cue chunk fits in the JUNK */
+extern void wav_mark(void);
+extern bool wav_marks;
+
 #endif /* WAV_H */